@@ -1,18 +1,124 @@
 #include <algorithm>
 #include <cassert>
 #include "BVH.hpp"
+#include "ThreadPool.hpp"
+
+// Above these primitive counts the builders hand work to the thread pool:
+// subtrees are built as separate tasks, and loops over primitives are cut
+// into chunks.
+static constexpr int kParallelSubtreeThreshold = 4096;
+static constexpr int kParallelChunkSize = 16384;
+
+static int chunkCount(int n)
+{
+    return std::max(1, std::min(ThreadPool::get().size() * 4, n / kParallelChunkSize));
+}
+
+// Calls func(chunk, begin, end) for nChunks equal slices of [start, end).
+template <typename Func>
+static void forEachChunk(int start, int end, int nChunks, const Func& func)
+{
+    auto run = [&](int c) {
+        func(c, start + (int)((long long)(end - start) * c / nChunks),
+             start + (int)((long long)(end - start) * (c + 1) / nChunks));
+    };
+    if (nChunks == 1) run(0);
+    else ThreadPool::get().parallelFor(nChunks, run);
+}
+
+// Accumulates func(partial, begin, end) over the chunks of [start, end) and
+// folds the partial results together with merge(into, from).
+template <typename T, typename Func, typename Merge>
+static T reduceChunks(int start, int end, int nChunks, const Func& func, const Merge& merge)
+{
+    if (nChunks == 1) {
+        T result;
+        func(result, start, end);
+        return result;
+    }
+    std::vector<T> partial(nChunks);
+    forEachChunk(start, end, nChunks, [&](int c, int begin, int end) {
+        func(partial[c], begin, end);
+    });
+    for (int c = 1; c < nChunks; ++c)
+        merge(partial[0], partial[c]);
+    return partial[0];
+}
+
+struct BVHPrimitiveInfo {
+    BVHPrimitiveInfo() {}
+    BVHPrimitiveInfo(int primitiveNumber, const Bounds3 &bounds)
+        : primitiveNumber(primitiveNumber), bounds(bounds),
+          centroid(.5f * bounds.pMin + .5f * bounds.pMax) {}
+    int primitiveNumber;
+    Bounds3 bounds;
+    Vector3f centroid;
+};
 
 BVHAccel::BVHAccel(std::vector<Object*> p, int maxPrimsInNode,
                    SplitMethod splitMethod)
     : maxPrimsInNode(std::min(255, maxPrimsInNode)), splitMethod(splitMethod),
       primitives(std::move(p))
+{
+    int n = (int)primitives.size();
+    std::vector<BVHPrimitiveInfo> primitiveInfo(n);
+    forEachChunk(0, n, chunkCount(n), [&](int, int begin, int end) {
+        for (int i = begin; i < end; ++i)
+            primitiveInfo[i] = {i, primitives[i]->getBounds()};
+    });
+    build(primitiveInfo);
+
+    std::vector<Object*> orderedPrims(n);
+    for (int i = 0; i < n; ++i)
+        orderedPrims[i] = primitives[primitiveOrder[i]];
+    primitives.swap(orderedPrims);
+}
+
+BVHAccel::BVHAccel(const std::vector<Bounds3>& bounds, int maxPrimsInNode, SplitMethod splitMethod)
+    : maxPrimsInNode(std::min(255, maxPrimsInNode)), splitMethod(splitMethod)
+{
+    int n = (int)bounds.size();
+    std::vector<BVHPrimitiveInfo> primitiveInfo(n);
+    forEachChunk(0, n, chunkCount(n), [&](int, int begin, int end) {
+        for (int i = begin; i < end; ++i)
+            primitiveInfo[i] = {i, bounds[i]};
+    });
+    build(primitiveInfo);
+}
+
+BVHAccel::BVHAccel(std::vector<WideBVHNode> nodes, const Bounds3 &worldBound, int maxPrimsInNode,
+                   SplitMethod splitMethod)
+    : maxPrimsInNode(std::min(255, maxPrimsInNode)), splitMethod(splitMethod), nodes(std::move(nodes)),
+      worldBound(worldBound)
+{
+    totalNodes = (int)this->nodes.size();
+}
+
+void BVHAccel::build(std::vector<BVHPrimitiveInfo>& primitiveInfo)
 {
     time_t start, stop;
     time(&start);
-    if (primitives.empty())
+    if (primitiveInfo.empty())
         return;
 
-    root = recursiveBuild(primitives);
+    // the build only ever reorders this one array in place; leaves refer to
+    // ranges of it
+    int n = (int)primitiveInfo.size();
+    BVHBuildNode* root = splitMethod == SplitMethod::LBVH
+                             ? buildLBVH(primitiveInfo)
+                             : recursiveBuild(primitiveInfo, 0, n, 0);
+
+    primitiveOrder.resize(n);
+    forEachChunk(0, n, chunkCount(n), [&](int, int begin, int end) {
+        for (int i = begin; i < end; ++i)
+            primitiveOrder[i] = primitiveInfo[i].primitiveNumber;
+    });
+
+    // collapse the binary tree into wide nodes, laid out depth-first
+    worldBound = root->bounds;
+    nodes.reserve(totalNodes / 4 + 1);
+    collapseBVHTree(root);
+    delete root;
 
     time(&stop);
     double diff = difftime(stop, start);
@@ -25,119 +131,621 @@ BVHAccel::BVHAccel(std::vector<Object*> p, int maxPrimsInNode,
         hrs, mins, secs);
 }
 
-BVHBuildNode* BVHAccel::recursiveBuild(std::vector<Object*> objects)
+BVHBuildNode* BVHAccel::recursiveBuild(std::vector<BVHPrimitiveInfo>& primitiveInfo,
+                                       int start, int end, int depth)
 {
     BVHBuildNode* node = new BVHBuildNode();
+    totalNodes++;
 
     // Compute bounds of all primitives in BVH node
-    Bounds3 bounds;
-    for (int i = 0; i < objects.size(); ++i)
-        bounds = Union(bounds, objects[i]->getBounds());
-    if (objects.size() == 1) {
-        // Create leaf _BVHBuildNode_
-        node->bounds = objects[0]->getBounds();
-        node->object = objects[0];
-        node->left = nullptr;
-        node->right = nullptr;
-        node->area = objects[0]->getArea();
-        return node;
-    }
-    else if (objects.size() == 2) {
-        node->left = recursiveBuild(std::vector{objects[0]});
-        node->right = recursiveBuild(std::vector{objects[1]});
+    int nPrimitives = end - start;
+    int nChunks = chunkCount(nPrimitives);
+    struct NodeExtent {
+        Bounds3 bounds, centroidBounds;
+    };
+    NodeExtent extent = reduceChunks<NodeExtent>(
+        start, end, nChunks,
+        [&](NodeExtent& e, int begin, int end) {
+            for (int i = begin; i < end; ++i) {
+                e.bounds = Union(e.bounds, primitiveInfo[i].bounds);
+                e.centroidBounds = Union(e.centroidBounds, primitiveInfo[i].centroid);
+            }
+        },
+        [](NodeExtent& into, const NodeExtent& from) {
+            into.bounds = Union(into.bounds, from.bounds);
+            into.centroidBounds = Union(into.centroidBounds, from.centroidBounds);
+        });
+    const Bounds3& bounds = extent.bounds;
+    const Bounds3& centroidBounds = extent.centroidBounds;
+    node->bounds = bounds;
 
-        node->bounds = Union(node->left->bounds, node->right->bounds);
-        node->area = node->left->area + node->right->area;
+    int dim = centroidBounds.maxExtent();
+    bool coincident = centroidBounds.pMax[dim] == centroidBounds.pMin[dim];
+    if (nPrimitives == 1 || (coincident && nPrimitives <= maxPrimsInNode)) {
+        // Create leaf _BVHBuildNode_; primitives with coincident centroids
+        // cannot be told apart by any split and share one leaf, unless there
+        // are too many of them for one, which the median split below halves
+        node->firstPrimOffset = start;
+        node->nPrimitives = nPrimitives;
         return node;
     }
-    else {
-        Bounds3 centroidBounds;
-        for (int i = 0; i < objects.size(); ++i)
-            centroidBounds =
-                Union(centroidBounds, objects[i]->getBounds().Centroid());
-        int dim = centroidBounds.maxExtent();
-        switch (dim) {
-        case 0:
-            std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
-                return f1->getBounds().Centroid().x <
-                       f2->getBounds().Centroid().x;
-            });
-            break;
-        case 1:
-            std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
-                return f1->getBounds().Centroid().y <
-                       f2->getBounds().Centroid().y;
-            });
+
+    int mid = (start + end) / 2;
+    // a tree this deep is degenerate; median splits bound what is left of it
+    switch (depth < kMedianSplitDepth ? splitMethod : SplitMethod::NAIVE) {
+    case SplitMethod::NAIVE:
+        // Partition primitives into equally sized subsets
+        std::nth_element(&primitiveInfo[start], &primitiveInfo[mid],
+                         &primitiveInfo[end - 1] + 1,
+                         [dim](const BVHPrimitiveInfo& a, const BVHPrimitiveInfo& b) {
+                             return a.centroid[dim] < b.centroid[dim];
+                         });
+        break;
+    case SplitMethod::SAH: {
+        if (nPrimitives <= 2) {
+            std::nth_element(&primitiveInfo[start], &primitiveInfo[mid],
+                             &primitiveInfo[end - 1] + 1,
+                             [dim](const BVHPrimitiveInfo& a, const BVHPrimitiveInfo& b) {
+                                 return a.centroid[dim] < b.centroid[dim];
+                             });
             break;
-        case 2:
-            std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
-                return f1->getBounds().Centroid().z <
-                       f2->getBounds().Centroid().z;
+        }
+        // Bin the centroids along every axis and evaluate the surface area
+        // heuristic at each bin boundary
+        constexpr int nBuckets = 16;
+        struct BucketInfo {
+            int count = 0;
+            Bounds3 bounds;
+        };
+        struct BucketGrid {
+            BucketInfo buckets[3][nBuckets];
+        };
+        auto bucketOf = [&](const Vector3f& c, int axis) {
+            int b = (int)(nBuckets * centroidBounds.Offset(c)[axis]);
+            return std::min(b, nBuckets - 1);
+        };
+        BucketGrid grid = reduceChunks<BucketGrid>(
+            start, end, nChunks,
+            [&](BucketGrid& g, int begin, int end) {
+                for (int i = begin; i < end; ++i) {
+                    for (int axis = 0; axis < 3; ++axis) {
+                        BucketInfo& bucket = g.buckets[axis][bucketOf(primitiveInfo[i].centroid, axis)];
+                        bucket.count++;
+                        bucket.bounds = Union(bucket.bounds, primitiveInfo[i].bounds);
+                    }
+                }
+            },
+            [](BucketGrid& into, const BucketGrid& from) {
+                for (int axis = 0; axis < 3; ++axis) {
+                    for (int i = 0; i < nBuckets; ++i) {
+                        into.buckets[axis][i].count += from.buckets[axis][i].count;
+                        into.buckets[axis][i].bounds =
+                            Union(into.buckets[axis][i].bounds, from.buckets[axis][i].bounds);
+                    }
+                }
             });
-            break;
+        const BucketInfo (&buckets)[3][nBuckets] = grid.buckets;
+
+        float minCost = std::numeric_limits<float>::infinity();
+        int minCostAxis = dim, minCostSplitBucket = -1;
+        for (int axis = 0; axis < 3; ++axis) {
+            if (centroidBounds.pMax[axis] == centroidBounds.pMin[axis])
+                continue;
+            // sweep from the right to get the cost of everything above each
+            // boundary, then from the left to finish the cost
+            float aboveCost[nBuckets];
+            Bounds3 b;
+            int count = 0;
+            for (int i = nBuckets - 1; i > 0; --i) {
+                b = Union(b, buckets[axis][i].bounds);
+                count += buckets[axis][i].count;
+                aboveCost[i] = count ? count * (float)b.SurfaceArea() : 0;
+            }
+            b = Bounds3();
+            count = 0;
+            for (int i = 0; i < nBuckets - 1; ++i) {
+                b = Union(b, buckets[axis][i].bounds);
+                count += buckets[axis][i].count;
+                if (count == 0 || count == nPrimitives)
+                    continue;
+                float cost = count * (float)b.SurfaceArea() + aboveCost[i + 1];
+                if (cost < minCost) {
+                    minCost = cost;
+                    minCostAxis = axis;
+                    minCostSplitBucket = i;
+                }
+            }
         }
 
-        auto beginning = objects.begin();
-        auto middling = objects.begin() + (objects.size() / 2);
-        auto ending = objects.end();
+        // Either split along the cheapest boundary or make a leaf; the
+        // traversal step is costed at 1/8 of a primitive test
+        float leafCost = nPrimitives;
+        minCost = .125f + minCost / (float)bounds.SurfaceArea();
+        if (minCostSplitBucket >= 0 &&
+            (nPrimitives > maxPrimsInNode || minCost < leafCost)) {
+            BVHPrimitiveInfo* pmid = std::partition(
+                &primitiveInfo[start], &primitiveInfo[end - 1] + 1,
+                [&](const BVHPrimitiveInfo& pi) {
+                    return bucketOf(pi.centroid, minCostAxis) <= minCostSplitBucket;
+                });
+            mid = pmid - &primitiveInfo[0];
+            dim = minCostAxis;
+        }
+        else if (nPrimitives <= maxPrimsInNode) {
+            node->firstPrimOffset = start;
+            node->nPrimitives = nPrimitives;
+            return node;
+        }
+        else {
+            std::nth_element(&primitiveInfo[start], &primitiveInfo[mid],
+                             &primitiveInfo[end - 1] + 1,
+                             [dim](const BVHPrimitiveInfo& a, const BVHPrimitiveInfo& b) {
+                                 return a.centroid[dim] < b.centroid[dim];
+                             });
+        }
+        break;
+    }
+    case SplitMethod::LBVH:
+        // LBVH trees are built by buildLBVH and never reach this function
+        assert(false);
+        break;
+    }
 
-        auto leftshapes = std::vector<Object*>(beginning, middling);
-        auto rightshapes = std::vector<Object*>(middling, ending);
+    node->splitAxis = dim;
+    // the two halves own disjoint ranges of primitiveInfo, so large ones are
+    // built concurrently
+    if (nPrimitives > kParallelSubtreeThreshold) {
+        ThreadPool::get().parallelFor(2, [&](int child) {
+            if (child == 0) node->left = recursiveBuild(primitiveInfo, start, mid, depth + 1);
+            else node->right = recursiveBuild(primitiveInfo, mid, end, depth + 1);
+        });
+    }
+    else {
+        node->left = recursiveBuild(primitiveInfo, start, mid, depth + 1);
+        node->right = recursiveBuild(primitiveInfo, mid, end, depth + 1);
+    }
+    return node;
+}
 
-        assert(objects.size() == (leftshapes.size() + rightshapes.size()));
+struct MortonPrimitive {
+    int primitiveIndex;
+    uint32_t mortonCode;
+};
 
-        node->left = recursiveBuild(leftshapes);
-        node->right = recursiveBuild(rightshapes);
+// Spreads the low 10 bits of x so that two zero bits follow each of them.
+inline uint32_t LeftShift3(uint32_t x)
+{
+    if (x == (1 << 10)) --x;
+    x = (x | (x << 16)) & 0x030000FF;
+    x = (x | (x << 8)) & 0x0300F00F;
+    x = (x | (x << 4)) & 0x030C30C3;
+    x = (x | (x << 2)) & 0x09249249;
+    return x;
+}
 
-        node->bounds = Union(node->left->bounds, node->right->bounds);
-        node->area = node->left->area + node->right->area;
+inline uint32_t EncodeMorton3(const Vector3f& v)
+{
+    return (LeftShift3((uint32_t)v.z) << 2) | (LeftShift3((uint32_t)v.y) << 1) |
+           LeftShift3((uint32_t)v.x);
+}
+
+// Least-significant-digit radix sort on the 30-bit codes, 6 bits per pass.
+// Every chunk counts its digits, a prefix sum over (digit, chunk) gives each
+// chunk its own output slots, and the chunks then scatter concurrently; the
+// sort stays stable whatever the chunking.
+static void RadixSort(std::vector<MortonPrimitive>* v)
+{
+    std::vector<MortonPrimitive> tempVector(v->size());
+    constexpr int bitsPerPass = 6;
+    constexpr int nBits = 30;
+    constexpr int nPasses = nBits / bitsPerPass;
+    constexpr int nBuckets = 1 << bitsPerPass;
+    constexpr int bitMask = nBuckets - 1;
+    int n = (int)v->size();
+    int nChunks = chunkCount(n);
+    std::vector<std::array<int, nBuckets>> offsets(nChunks);
+    for (int pass = 0; pass < nPasses; ++pass) {
+        int lowBit = pass * bitsPerPass;
+        std::vector<MortonPrimitive>& in = (pass & 1) ? tempVector : *v;
+        std::vector<MortonPrimitive>& out = (pass & 1) ? *v : tempVector;
+
+        forEachChunk(0, n, nChunks, [&](int c, int begin, int end) {
+            offsets[c].fill(0);
+            for (int i = begin; i < end; ++i)
+                offsets[c][(in[i].mortonCode >> lowBit) & bitMask]++;
+        });
+        int sum = 0;
+        for (int b = 0; b < nBuckets; ++b) {
+            for (int c = 0; c < nChunks; ++c) {
+                int count = offsets[c][b];
+                offsets[c][b] = sum;
+                sum += count;
+            }
+        }
+        forEachChunk(0, n, nChunks, [&](int c, int begin, int end) {
+            for (int i = begin; i < end; ++i)
+                out[offsets[c][(in[i].mortonCode >> lowBit) & bitMask]++] = in[i];
+        });
     }
+    if (nPasses & 1)
+        std::swap(*v, tempVector);
+}
+
+BVHBuildNode* BVHAccel::buildLBVH(std::vector<BVHPrimitiveInfo>& primitiveInfo)
+{
+    int n = (int)primitiveInfo.size();
+    int nChunks = chunkCount(n);
+
+    // Compute bounding box of all primitive centroids
+    Bounds3 centroidBounds = reduceChunks<Bounds3>(
+        0, n, nChunks,
+        [&](Bounds3& b, int begin, int end) {
+            for (int i = begin; i < end; ++i)
+                b = Union(b, primitiveInfo[i].centroid);
+        },
+        [](Bounds3& into, const Bounds3& from) { into = Union(into, from); });
 
+    // Compute Morton indices of primitives and sort them
+    std::vector<MortonPrimitive> mortonPrims(n);
+    forEachChunk(0, n, nChunks, [&](int, int begin, int end) {
+        constexpr int mortonScale = 1 << 10;
+        for (int i = begin; i < end; ++i) {
+            mortonPrims[i].primitiveIndex = i;
+            Vector3f centroidOffset = centroidBounds.Offset(primitiveInfo[i].centroid);
+            mortonPrims[i].mortonCode = EncodeMorton3(centroidOffset * mortonScale);
+        }
+    });
+    RadixSort(&mortonPrims);
+
+    // put primitiveInfo in Morton order so that leaves can refer to ranges
+    std::vector<BVHPrimitiveInfo> sortedInfo(n);
+    forEachChunk(0, n, nChunks, [&](int, int begin, int end) {
+        for (int i = begin; i < end; ++i)
+            sortedInfo[i] = primitiveInfo[mortonPrims[i].primitiveIndex];
+    });
+    primitiveInfo.swap(sortedInfo);
+
+    return emitLBVH(primitiveInfo, mortonPrims, 0, n, 29, 0);
+}
+
+BVHBuildNode* BVHAccel::emitLBVH(const std::vector<BVHPrimitiveInfo>& primitiveInfo,
+                                 const std::vector<MortonPrimitive>& mortonPrims,
+                                 int start, int end, int bitIndex, int depth)
+{
+    int nPrimitives = end - start;
+    if (nPrimitives <= maxPrimsInNode) {
+        // Create and return leaf node of LBVH treelet
+        BVHBuildNode* node = new BVHBuildNode();
+        totalNodes++;
+        for (int i = start; i < end; ++i)
+            node->bounds = Union(node->bounds, primitiveInfo[i].bounds);
+        node->firstPrimOffset = start;
+        node->nPrimitives = nPrimitives;
+        return node;
+    }
+
+    int splitOffset;
+    if (bitIndex < 0 || depth >= kMedianSplitDepth) {
+        // identical codes all the way down, or a tree deep enough that only
+        // median splits keep it within kMaxBVHDepth
+        splitOffset = (start + end) / 2;
+    }
+    else {
+        uint32_t mask = 1u << bitIndex;
+        // Advance to next subtree level if there's no LBVH split for this bit
+        if ((mortonPrims[start].mortonCode & mask) ==
+            (mortonPrims[end - 1].mortonCode & mask))
+            return emitLBVH(primitiveInfo, mortonPrims, start, end, bitIndex - 1, depth);
+
+        // Find LBVH split point for this dimension
+        int searchStart = start, searchEnd = end - 1;
+        while (searchStart + 1 != searchEnd) {
+            int mid = (searchStart + searchEnd) / 2;
+            if ((mortonPrims[searchStart].mortonCode & mask) ==
+                (mortonPrims[mid].mortonCode & mask))
+                searchStart = mid;
+            else
+                searchEnd = mid;
+        }
+        splitOffset = searchEnd;
+    }
+
+    // Create and return interior LBVH node
+    BVHBuildNode* node = new BVHBuildNode();
+    totalNodes++;
+    node->splitAxis = bitIndex < 0 ? 0 : bitIndex % 3;
+    if (nPrimitives > kParallelSubtreeThreshold) {
+        ThreadPool::get().parallelFor(2, [&](int child) {
+            if (child == 0)
+                node->left = emitLBVH(primitiveInfo, mortonPrims, start, splitOffset, bitIndex - 1, depth + 1);
+            else
+                node->right = emitLBVH(primitiveInfo, mortonPrims, splitOffset, end, bitIndex - 1, depth + 1);
+        });
+    }
+    else {
+        node->left = emitLBVH(primitiveInfo, mortonPrims, start, splitOffset, bitIndex - 1, depth + 1);
+        node->right = emitLBVH(primitiveInfo, mortonPrims, splitOffset, end, bitIndex - 1, depth + 1);
+    }
+    node->bounds = Union(node->left->bounds, node->right->bounds);
     return node;
 }
 
-Intersection BVHAccel::Intersect(const Ray& ray) const
+int BVHAccel::collapseBVHTree(BVHBuildNode* node)
 {
-    Intersection isect;
-    if (!root)
-        return isect;
-    isect = BVHAccel::getIntersection(root, ray);
-    return isect;
+    // Pull subtrees up into this node until it has kWidth children, always
+    // opening the interior child with the largest surface area: that is the
+    // child rays are most likely to enter. A leaf root gets a node of its own.
+    BVHBuildNode* children[WideBVHNode::kWidth];
+    int n = 0;
+    if (node->nPrimitives > 0)
+        children[n++] = node;
+    else {
+        children[n++] = node->left;
+        children[n++] = node->right;
+    }
+    while (n < WideBVHNode::kWidth) {
+        int largest = -1;
+        double largestArea = 0;
+        for (int i = 0; i < n; ++i) {
+            double area = children[i]->bounds.SurfaceArea();
+            if (children[i]->nPrimitives == 0 && (largest < 0 || area > largestArea)) {
+                largest = i;
+                largestArea = area;
+            }
+        }
+        if (largest < 0)
+            break;
+        BVHBuildNode* opened = children[largest];
+        children[largest] = opened->left;
+        children[n++] = opened->right;
+    }
+
+    int myOffset = (int)nodes.size();
+    nodes.emplace_back();
+    WideBVHNode& wideNode = nodes[myOffset];
+    Bounds3 empty;
+    for (int i = 0; i < WideBVHNode::kWidth; ++i) {
+        const Bounds3& b = i < n ? children[i]->bounds : empty;
+        for (int axis = 0; axis < 3; ++axis) {
+            wideNode.bounds[0][axis][i] = b.pMin[axis];
+            wideNode.bounds[1][axis][i] = b.pMax[axis];
+        }
+        wideNode.child[i] = 0;
+        wideNode.nPrimitives[i] = 0;
+    }
+    wideNode.numChildren = n;
+    for (int i = 0; i < n; ++i) {
+        if (children[i]->nPrimitives > 0) {
+            nodes[myOffset].child[i] = children[i]->firstPrimOffset;
+            nodes[myOffset].nPrimitives[i] = children[i]->nPrimitives;
+        }
+        else {
+            // nodes may not be touched through wideNode after the recursion
+            int childOffset = collapseBVHTree(children[i]);
+            nodes[myOffset].child[i] = childOffset;
+        }
+    }
+    return myOffset;
+}
+
+int intersectChildrenScalar(const WideBVHNode& node, const Ray& ray, const Vector3f& invDir,
+                            const int dirIsNeg[3], float tEnter[WideBVHNode::kWidth])
+{
+    int hits = 0;
+    for (int i = 0; i < node.numChildren; ++i) {
+        float tx0 = (node.bounds[dirIsNeg[0]][0][i] - ray.origin.x) * invDir.x;
+        float tx1 = (node.bounds[1 - dirIsNeg[0]][0][i] - ray.origin.x) * invDir.x;
+        float ty0 = (node.bounds[dirIsNeg[1]][1][i] - ray.origin.y) * invDir.y;
+        float ty1 = (node.bounds[1 - dirIsNeg[1]][1][i] - ray.origin.y) * invDir.y;
+        float tz0 = (node.bounds[dirIsNeg[2]][2][i] - ray.origin.z) * invDir.z;
+        float tz1 = (node.bounds[1 - dirIsNeg[2]][2][i] - ray.origin.z) * invDir.z;
+        float t0 = std::max(tx0, std::max(ty0, tz0));
+        float t1 = std::min(tx1, std::min(ty1, tz1));
+        tEnter[i] = t0;
+        if (t0 < t1 + 1e-4f && t1 > ray.t_min && t0 <= ray.t_max)
+            hits |= 1 << i;
+    }
+    return hits;
 }
 
-Intersection BVHAccel::getIntersection(BVHBuildNode* node, const Ray& ray) const
+uint32_t intersectChildPacketScalar(const WideBVHNode& node, int i, const RayPacket& packet,
+                                    uint32_t active, float& tEnter)
 {
-    Intersection isec = Intersection();
-    Vector3f inv_dir = ray.direction_inv;
-    std::array<int,3> dirIsNeg;
-    dirIsNeg[0] = inv_dir.x < 0 ? 1 : 0;
-    dirIsNeg[1] = inv_dir.y < 0 ? 1 : 0;
-    dirIsNeg[2] = inv_dir.z < 0 ? 1 : 0;
-    
-    bool inter = node->bounds.IntersectP(ray, inv_dir, dirIsNeg);
-    if (!inter) return isec;
-    if (node->left == NULL && node->right == NULL) {
-        Intersection intes = node->object->getIntersection(ray);
-        return intes.happened ? intes : isec;
+    // rays in a packet need not agree on direction signs, so near and far
+    // planes are sorted per ray
+    float lo[3] = {node.bounds[0][0][i], node.bounds[0][1][i], node.bounds[0][2][i]};
+    float hi[3] = {node.bounds[1][0][i], node.bounds[1][1][i], node.bounds[1][2][i]};
+    uint32_t hits = 0;
+    tEnter = std::numeric_limits<float>::infinity();
+    for (int r = 0; r < packet.count; ++r) {
+        if (!(active & (1u << r)))
+            continue;
+        float t0 = -std::numeric_limits<float>::infinity();
+        float t1 = std::numeric_limits<float>::infinity();
+        for (int axis = 0; axis < 3; ++axis) {
+            float tLo = (lo[axis] - packet.origin[axis][r]) * packet.invDir[axis][r];
+            float tHi = (hi[axis] - packet.origin[axis][r]) * packet.invDir[axis][r];
+            t0 = std::max(t0, std::min(tLo, tHi));
+            t1 = std::min(t1, std::max(tLo, tHi));
+        }
+        if (t0 < t1 + 1e-4f && t1 > packet.tMin[r] && t0 <= packet.tMax[r]) {
+            hits |= 1u << r;
+            tEnter = std::min(tEnter, t0);
+        }
     }
-    Intersection left_child = BVHAccel::getIntersection(node->left, ray);
-    Intersection right_child = BVHAccel::getIntersection(node->right, ray);
-    return right_child.distance > left_child.distance ? left_child : right_child;
+    return hits;
 }
 
+#ifdef RAYTRACING_X86_SIMD
 
-void BVHAccel::getSample(BVHBuildNode* node, float p, Intersection &pos, float &pdf){
-    if(node->left == nullptr || node->right == nullptr){
-        node->object->Sample(pos, pdf);
-        pdf *= node->area;
-        return;
+// The SIMD versions mirror the scalar test above. std::max(a, b) and
+// std::min(a, b) keep a when b is NaN, as _mm_max_ps(b, a) and
+// _mm_min_ps(b, a) do, so the operand order below is deliberate.
+int intersectChildrenSSE(const WideBVHNode& node, const Ray& ray, const Vector3f& invDir,
+                         const int dirIsNeg[3], float tEnter[WideBVHNode::kWidth])
+{
+    const float origin[3] = {ray.origin.x, ray.origin.y, ray.origin.z};
+    const float inv[3] = {invDir.x, invDir.y, invDir.z};
+    int hits = 0;
+    for (int half = 0; half < node.numChildren; half += 4) {
+        __m128 t0 = _mm_undefined_ps(), t1 = _mm_undefined_ps();
+        for (int axis = 2; axis >= 0; --axis) {
+            __m128 o = _mm_set1_ps(origin[axis]), d = _mm_set1_ps(inv[axis]);
+            __m128 near = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&node.bounds[dirIsNeg[axis]][axis][half]), o), d);
+            __m128 far = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&node.bounds[1 - dirIsNeg[axis]][axis][half]), o), d);
+            t0 = axis == 2 ? near : _mm_max_ps(t0, near);
+            t1 = axis == 2 ? far : _mm_min_ps(t1, far);
+        }
+        _mm_storeu_ps(tEnter + half, t0);
+        __m128 hit = _mm_and_ps(_mm_cmplt_ps(t0, _mm_add_ps(t1, _mm_set1_ps(1e-4f))),
+                                _mm_and_ps(_mm_cmpgt_ps(t1, _mm_set1_ps(ray.t_min)),
+                                           _mm_cmple_ps(t0, _mm_set1_ps(ray.t_max))));
+        hits |= _mm_movemask_ps(hit) << half;
     }
-    if(p < node->left->area) getSample(node->left, p, pos, pdf);
-    else getSample(node->right, p - node->left->area, pos, pdf);
+    return hits & ((1 << node.numChildren) - 1);
 }
 
-void BVHAccel::Sample(Intersection &pos, float &pdf){
-    float p = std::sqrt(get_random_float()) * root->area;
-    getSample(root, p, pos, pdf);
-    pdf /= root->area;
-}
\ No newline at end of file
+RAYTRACING_AVX2 int intersectChildrenAVX2(const WideBVHNode& node, const Ray& ray, const Vector3f& invDir,
+                                          const int dirIsNeg[3], float tEnter[WideBVHNode::kWidth])
+{
+    const float origin[3] = {ray.origin.x, ray.origin.y, ray.origin.z};
+    const float inv[3] = {invDir.x, invDir.y, invDir.z};
+    __m256 t0 = _mm256_undefined_ps(), t1 = _mm256_undefined_ps();
+    for (int axis = 2; axis >= 0; --axis) {
+        __m256 o = _mm256_set1_ps(origin[axis]), d = _mm256_set1_ps(inv[axis]);
+        __m256 near = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[dirIsNeg[axis]][axis]), o), d);
+        __m256 far = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[1 - dirIsNeg[axis]][axis]), o), d);
+        t0 = axis == 2 ? near : _mm256_max_ps(t0, near);
+        t1 = axis == 2 ? far : _mm256_min_ps(t1, far);
+    }
+    _mm256_storeu_ps(tEnter, t0);
+    __m256 hit = _mm256_and_ps(_mm256_cmp_ps(t0, _mm256_add_ps(t1, _mm256_set1_ps(1e-4f)), _CMP_LT_OQ),
+                               _mm256_and_ps(_mm256_cmp_ps(t1, _mm256_set1_ps(ray.t_min), _CMP_GT_OQ),
+                                             _mm256_cmp_ps(t0, _mm256_set1_ps(ray.t_max), _CMP_LE_OQ)));
+    return _mm256_movemask_ps(hit) & ((1 << node.numChildren) - 1);
+}
+
+uint32_t intersectChildPacketSSE(const WideBVHNode& node, int i, const RayPacket& packet,
+                                 uint32_t active, float& tEnter)
+{
+    __m128 lo[3], hi[3];
+    for (int axis = 0; axis < 3; ++axis) {
+        lo[axis] = _mm_set1_ps(node.bounds[0][axis][i]);
+        hi[axis] = _mm_set1_ps(node.bounds[1][axis][i]);
+    }
+    const __m128i laneBits = _mm_setr_epi32(1, 2, 4, 8);
+    uint32_t hits = 0;
+    __m128 nearest = _mm_set1_ps(std::numeric_limits<float>::infinity());
+    for (int r = 0; r < packet.count; r += 4) {
+        if (!((active >> r) & 0xf))
+            continue;
+        __m128 live = _mm_castsi128_ps(_mm_cmpeq_epi32(
+                _mm_and_si128(_mm_set1_epi32((int)(active >> r)), laneBits), laneBits));
+        __m128 t0 = _mm_set1_ps(-std::numeric_limits<float>::infinity());
+        __m128 t1 = _mm_set1_ps(std::numeric_limits<float>::infinity());
+        for (int axis = 0; axis < 3; ++axis) {
+            __m128 o = _mm_load_ps(&packet.origin[axis][r]), d = _mm_load_ps(&packet.invDir[axis][r]);
+            __m128 tLo = _mm_mul_ps(_mm_sub_ps(lo[axis], o), d);
+            __m128 tHi = _mm_mul_ps(_mm_sub_ps(hi[axis], o), d);
+            t0 = _mm_max_ps(t0, _mm_min_ps(tLo, tHi));
+            t1 = _mm_min_ps(t1, _mm_max_ps(tLo, tHi));
+        }
+        __m128 hit = _mm_and_ps(_mm_cmplt_ps(t0, _mm_add_ps(t1, _mm_set1_ps(1e-4f))),
+                                _mm_and_ps(_mm_cmpgt_ps(t1, _mm_load_ps(&packet.tMin[r])),
+                                           _mm_cmple_ps(t0, _mm_load_ps(&packet.tMax[r]))));
+        hit = _mm_and_ps(hit, live);
+        nearest = _mm_min_ps(nearest, _mm_or_ps(_mm_and_ps(hit, t0),
+                                                _mm_andnot_ps(hit, _mm_set1_ps(std::numeric_limits<float>::infinity()))));
+        hits |= (uint32_t)_mm_movemask_ps(hit) << r;
+    }
+    nearest = _mm_min_ps(nearest, _mm_shuffle_ps(nearest, nearest, _MM_SHUFFLE(2, 3, 0, 1)));
+    nearest = _mm_min_ps(nearest, _mm_shuffle_ps(nearest, nearest, _MM_SHUFFLE(1, 0, 3, 2)));
+    tEnter = _mm_cvtss_f32(nearest);
+    return hits;
+}
+
+RAYTRACING_AVX2 uint32_t intersectChildPacketAVX2(const WideBVHNode& node, int i, const RayPacket& packet,
+                                                  uint32_t active, float& tEnter)
+{
+    __m256 lo[3], hi[3];
+    for (int axis = 0; axis < 3; ++axis) {
+        lo[axis] = _mm256_set1_ps(node.bounds[0][axis][i]);
+        hi[axis] = _mm256_set1_ps(node.bounds[1][axis][i]);
+    }
+    const __m256 inf = _mm256_set1_ps(std::numeric_limits<float>::infinity());
+    const __m256i laneBits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    uint32_t hits = 0;
+    __m256 nearest = inf;
+    for (int r = 0; r < packet.count; r += 8) {
+        if (!((active >> r) & 0xff))
+            continue;
+        __m256 live = _mm256_castsi256_ps(_mm256_cmpeq_epi32(
+                _mm256_and_si256(_mm256_set1_epi32((int)(active >> r)), laneBits), laneBits));
+        __m256 t0 = _mm256_set1_ps(-std::numeric_limits<float>::infinity());
+        __m256 t1 = inf;
+        for (int axis = 0; axis < 3; ++axis) {
+            __m256 o = _mm256_load_ps(&packet.origin[axis][r]), d = _mm256_load_ps(&packet.invDir[axis][r]);
+            __m256 tLo = _mm256_mul_ps(_mm256_sub_ps(lo[axis], o), d);
+            __m256 tHi = _mm256_mul_ps(_mm256_sub_ps(hi[axis], o), d);
+            t0 = _mm256_max_ps(t0, _mm256_min_ps(tLo, tHi));
+            t1 = _mm256_min_ps(t1, _mm256_max_ps(tLo, tHi));
+        }
+        __m256 hit = _mm256_and_ps(_mm256_cmp_ps(t0, _mm256_add_ps(t1, _mm256_set1_ps(1e-4f)), _CMP_LT_OQ),
+                                   _mm256_and_ps(_mm256_cmp_ps(t1, _mm256_load_ps(&packet.tMin[r]), _CMP_GT_OQ),
+                                                 _mm256_cmp_ps(t0, _mm256_load_ps(&packet.tMax[r]), _CMP_LE_OQ)));
+        hit = _mm256_and_ps(hit, live);
+        nearest = _mm256_min_ps(nearest, _mm256_blendv_ps(inf, t0, hit));
+        hits |= (uint32_t)_mm256_movemask_ps(hit) << r;
+    }
+    __m128 m = _mm_min_ps(_mm256_castps256_ps128(nearest), _mm256_extractf128_ps(nearest, 1));
+    m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+    m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+    tEnter = _mm_cvtss_f32(m);
+    return hits;
+}
+
+#endif // RAYTRACING_X86_SIMD
+
+BVHAccel::~BVHAccel() = default;
+
+Bounds3 BVHAccel::WorldBound() const
+{
+    return worldBound;
+}
+
+Intersection BVHAccel::Intersect(const Ray& r) const
+{
+    Intersection isect;
+    // t_max of this copy shrinks to every hit, so farther nodes and
+    // primitives get culled; nested BVHs receive the clipped ray as well
+    Ray ray = r;
+    traverse(ray, [&](int first, int count, Ray& ray) {
+        for (int i = first; i < first + count; ++i) {
+            Intersection inter = primitives[i]->getIntersection(ray);
+            if (inter.happened && inter.distance <= ray.t_max) {
+                isect = inter;
+                ray.t_max = inter.distance;
+            }
+        }
+    });
+    return isect;
+}
+
+void BVHAccel::Intersect(RayPacket& packet, uint32_t active, Intersection* isects) const
+{
+    traversePacket(packet, active, [&](int first, int count, RayPacket& packet, uint32_t rays) {
+        for (int i = first; i < first + count; ++i)
+            primitives[i]->getIntersections(packet, rays, isects);
+    });
+}
+
+bool BVHAccel::IntersectP(const Ray& ray) const
+{
+    return traverseAny(ray, [&](int first, int count, const Ray& ray) {
+        for (int i = first; i < first + count; ++i) {
+            if (primitives[i]->intersect(ray))
+                return true;
+        }
+        return false;
+    });
+}
@@ -10,10 +10,74 @@
 #include "Bounds3.hpp"
 #include "Intersection.hpp"
 #include "Vector.hpp"
+#include "Simd.hpp"
+#include "RayPacket.hpp"
 
 struct BVHBuildNode;
 // BVHAccel Forward Declarations
 struct BVHPrimitiveInfo;
+struct MortonPrimitive;
+
+// Node of the 8-wide BVH that traversal runs on. The binary tree the
+// builders produce is collapsed so that every node has up to eight children,
+// whose boxes are kept as structure-of-arrays: one SIMD slab test covers all
+// of them. A child is either another node or a leaf, i.e. a range of
+// primitive slots. Nodes are stored depth-first.
+struct alignas(64) WideBVHNode {
+    static constexpr int kWidth = 8;
+    float bounds[2][3][kWidth];   // [pMin / pMax][axis][child]
+    int child[kWidth];            // interior child: node index, leaf: first slot
+    uint16_t nPrimitives[kWidth]; // 0 -> interior child
+    int numChildren;
+};
+
+// Slab test of a ray against the children of a node. Returns a bit mask of
+// the children whose boxes the ray enters within [ray.t_min, ray.t_max] and
+// stores every child's entry distance in tEnter.
+int intersectChildrenScalar(const WideBVHNode &node, const Ray &ray, const Vector3f &invDir,
+                            const int dirIsNeg[3], float tEnter[WideBVHNode::kWidth]);
+#ifdef RAYTRACING_X86_SIMD
+int intersectChildrenSSE(const WideBVHNode &node, const Ray &ray, const Vector3f &invDir,
+                         const int dirIsNeg[3], float tEnter[WideBVHNode::kWidth]);
+int intersectChildrenAVX2(const WideBVHNode &node, const Ray &ray, const Vector3f &invDir,
+                          const int dirIsNeg[3], float tEnter[WideBVHNode::kWidth]);
+#endif
+
+// Slab test of the rays of a packet against child i of a node. Returns the
+// subset of the rays in `active` that enter its box within their intervals,
+// and in tEnter the smallest entry distance among them.
+uint32_t intersectChildPacketScalar(const WideBVHNode &node, int i, const RayPacket &packet,
+                                    uint32_t active, float &tEnter);
+#ifdef RAYTRACING_X86_SIMD
+uint32_t intersectChildPacketSSE(const WideBVHNode &node, int i, const RayPacket &packet,
+                                 uint32_t active, float &tEnter);
+uint32_t intersectChildPacketAVX2(const WideBVHNode &node, int i, const RayPacket &packet,
+                                  uint32_t active, float &tEnter);
+#endif
+
+inline int intersectChildren(const WideBVHNode &node, const Ray &ray, const Vector3f &invDir,
+                             const int dirIsNeg[3], float tEnter[WideBVHNode::kWidth])
+{
+#ifdef RAYTRACING_X86_SIMD
+    if (simdLevel == SimdLevel::AVX2)
+        return intersectChildrenAVX2(node, ray, invDir, dirIsNeg, tEnter);
+    if (simdLevel == SimdLevel::SSE)
+        return intersectChildrenSSE(node, ray, invDir, dirIsNeg, tEnter);
+#endif
+    return intersectChildrenScalar(node, ray, invDir, dirIsNeg, tEnter);
+}
+
+inline uint32_t intersectChildPacket(const WideBVHNode &node, int i, const RayPacket &packet,
+                                     uint32_t active, float &tEnter)
+{
+#ifdef RAYTRACING_X86_SIMD
+    if (simdLevel == SimdLevel::AVX2)
+        return intersectChildPacketAVX2(node, i, packet, active, tEnter);
+    if (simdLevel == SimdLevel::SSE)
+        return intersectChildPacketSSE(node, i, packet, active, tEnter);
+#endif
+    return intersectChildPacketScalar(node, i, packet, active, tEnter);
+}
 
 // BVHAccel Declarations
 inline int leafNodes, totalLeafNodes, totalPrimitives, interiorNodes;
@@ -21,36 +85,191 @@ class BVHAccel {
 
 public:
     // BVHAccel Public Types
-    enum class SplitMethod { NAIVE, SAH };
+    // NAIVE: median split on the widest axis
+    // SAH: binned surface area heuristic
+    // LBVH: primitives sorted along a 30-bit Morton curve and split on the
+    //       code bits; much faster to build, somewhat slower to trace
+    enum class SplitMethod { NAIVE, SAH, LBVH };
 
     // BVHAccel Public Methods
-    BVHAccel(std::vector<Object*> p, int maxPrimsInNode = 1, SplitMethod splitMethod = SplitMethod::NAIVE);
+    BVHAccel(std::vector<Object*> p, int maxPrimsInNode = 4, SplitMethod splitMethod = SplitMethod::SAH);
+    // Builds over bare bounds, for primitives that are not Objects such as
+    // the triangles of a MeshTriangle. primitiveOrder[slot] tells which input
+    // primitive a leaf slot stands for, so the caller can lay its own data
+    // out in leaf order.
+    BVHAccel(const std::vector<Bounds3>& bounds, int maxPrimsInNode = 4,
+             SplitMethod splitMethod = SplitMethod::SAH);
+    // Takes over a tree that a build over bare bounds produced, as
+    // MeshCache stores it.
+    BVHAccel(std::vector<WideBVHNode> nodes, const Bounds3 &worldBound, int maxPrimsInNode,
+             SplitMethod splitMethod);
     Bounds3 WorldBound() const;
     ~BVHAccel();
 
     Intersection Intersect(const Ray &ray) const;
-    Intersection getIntersection(BVHBuildNode* node, const Ray& ray)const;
     bool IntersectP(const Ray &ray) const;
-    BVHBuildNode* root;
+    // closest hits of the rays in `active`; isects[i] is only overwritten by
+    // hits nearer than packet.tMax[i]
+    void Intersect(RayPacket &packet, uint32_t active, Intersection *isects) const;
+
+    // Closest-hit traversal: intersectLeaf(first, count, ray) tests the leaf
+    // slots [first, first + count) and pulls ray.t_max in to any hit.
+    template <typename LeafFn>
+    void traverse(Ray &ray, LeafFn &&intersectLeaf) const;
+    // Closest-hit traversal of a packet: a child is entered when any of the
+    // rays does, and intersectLeaf(first, count, packet, rays) tests the rays
+    // in the mask that reached the leaf, clipping the packet to any hit.
+    template <typename LeafFn>
+    void traversePacket(RayPacket &packet, uint32_t active, LeafFn &&intersectLeaf) const;
+    // Any-hit traversal: occludedLeaf(first, count, ray) returns true as soon
+    // as a slot is hit within the ray's interval.
+    template <typename LeafFn>
+    bool traverseAny(const Ray &ray, LeafFn &&occludedLeaf) const;
 
     // BVHAccel Private Methods
-    BVHBuildNode* recursiveBuild(std::vector<Object*>objects);
+    void build(std::vector<BVHPrimitiveInfo>& primitiveInfo);
+    BVHBuildNode* recursiveBuild(std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end, int depth);
+    BVHBuildNode* buildLBVH(std::vector<BVHPrimitiveInfo>& primitiveInfo);
+    BVHBuildNode* emitLBVH(const std::vector<BVHPrimitiveInfo>& primitiveInfo,
+                           const std::vector<MortonPrimitive>& mortonPrims,
+                           int start, int end, int bitIndex, int depth);
+    int collapseBVHTree(BVHBuildNode *node);
 
     // BVHAccel Private Data
     const int maxPrimsInNode;
     const SplitMethod splitMethod;
     std::vector<Object*> primitives;
-
-    void getSample(BVHBuildNode* node, float p, Intersection &pos, float &pdf);
-    void Sample(Intersection &pos, float &pdf);
+    std::vector<int> primitiveOrder;
+    std::vector<WideBVHNode> nodes;
+    std::atomic<int> totalNodes{0};
+    Bounds3 worldBound;
 };
 
+// Interior levels of any tree the builds produce: from kMedianSplitDepth
+// down they split at the median, which halves the primitives at every level,
+// so up to 2^31 primitives fit.
+static constexpr int kMaxBVHDepth = 64;
+static constexpr int kMedianSplitDepth = kMaxBVHDepth - 32;
+
+// Every visited node leaves at most kWidth - 1 children on the stack per
+// level, and the collapsed tree is no deeper than the binary one.
+static constexpr int kTraversalStackSize = (WideBVHNode::kWidth - 1) * kMaxBVHDepth + 1;
+
+template <typename LeafFn>
+void BVHAccel::traverse(Ray &ray, LeafFn &&intersectLeaf) const
+{
+    if (nodes.empty())
+        return;
+    Vector3f invDir = ray.direction_inv;
+    int dirIsNeg[3] = {invDir.x < 0, invDir.y < 0, invDir.z < 0};
+    // children still to visit, with the distance at which the ray enters
+    // them; the nearest is always on top
+    struct StackEntry {
+        int child;
+        int nPrimitives;
+        float tEnter;
+    };
+    StackEntry stack[kTraversalStackSize];
+    int top = 0;
+    stack[top++] = {0, 0, ray.t_min};
+    while (top > 0) {
+        StackEntry entry = stack[--top];
+        // skip children that lie beyond a hit found since they were pushed
+        if (entry.tEnter > ray.t_max)
+            continue;
+        if (entry.nPrimitives > 0) {
+            intersectLeaf(entry.child, entry.nPrimitives, ray);
+            continue;
+        }
+        const WideBVHNode &node = nodes[entry.child];
+        float tEnter[WideBVHNode::kWidth];
+        int hits = intersectChildren(node, ray, invDir, dirIsNeg, tEnter);
+        // insert the children hit far to near, so they come off front to back
+        int first = top;
+        for (int i = 0; i < node.numChildren; ++i) {
+            if (!(hits & (1 << i)))
+                continue;
+            int j = top++;
+            while (j > first && stack[j - 1].tEnter < tEnter[i]) {
+                stack[j] = stack[j - 1];
+                --j;
+            }
+            stack[j] = {node.child[i], node.nPrimitives[i], tEnter[i]};
+        }
+    }
+}
+
+template <typename LeafFn>
+void BVHAccel::traversePacket(RayPacket &packet, uint32_t active, LeafFn &&intersectLeaf) const
+{
+    if (nodes.empty() || !active)
+        return;
+    // as in traverse, but every entry carries the rays that reached it and is
+    // ordered by the nearest of their entry distances
+    struct StackEntry {
+        int child;
+        int nPrimitives;
+        uint32_t rays;
+        float tEnter;
+    };
+    StackEntry stack[kTraversalStackSize];
+    int top = 0;
+    stack[top++] = {0, 0, active, 0.f};
+    while (top > 0) {
+        StackEntry entry = stack[--top];
+        if (entry.nPrimitives > 0) {
+            intersectLeaf(entry.child, entry.nPrimitives, packet, entry.rays);
+            continue;
+        }
+        const WideBVHNode &node = nodes[entry.child];
+        int first = top;
+        for (int i = 0; i < node.numChildren; ++i) {
+            float tEnter;
+            uint32_t rays = intersectChildPacket(node, i, packet, entry.rays, tEnter);
+            if (!rays)
+                continue;
+            int j = top++;
+            while (j > first && stack[j - 1].tEnter < tEnter) {
+                stack[j] = stack[j - 1];
+                --j;
+            }
+            stack[j] = {node.child[i], node.nPrimitives[i], rays, tEnter};
+        }
+    }
+}
+
+template <typename LeafFn>
+bool BVHAccel::traverseAny(const Ray &ray, LeafFn &&occludedLeaf) const
+{
+    if (nodes.empty())
+        return false;
+    // Any-hit query: unlike traverse it neither orders children nor keeps
+    // the closest hit, and returns at the first primitive in range
+    Vector3f invDir = ray.direction_inv;
+    int dirIsNeg[3] = {invDir.x < 0, invDir.y < 0, invDir.z < 0};
+    int nodesToVisit[kTraversalStackSize];
+    int top = 0;
+    nodesToVisit[top++] = 0;
+    while (top > 0) {
+        const WideBVHNode &node = nodes[nodesToVisit[--top]];
+        float tEnter[WideBVHNode::kWidth];
+        int hits = intersectChildren(node, ray, invDir, dirIsNeg, tEnter);
+        for (int i = 0; i < node.numChildren; ++i) {
+            if (!(hits & (1 << i)))
+                continue;
+            if (node.nPrimitives[i] == 0)
+                nodesToVisit[top++] = node.child[i];
+            else if (occludedLeaf(node.child[i], (int)node.nPrimitives[i], ray))
+                return true;
+        }
+    }
+    return false;
+}
+
 struct BVHBuildNode {
     Bounds3 bounds;
     BVHBuildNode *left;
     BVHBuildNode *right;
-    Object* object;
-    float area;
 
 public:
     int splitAxis=0, firstPrimOffset=0, nPrimitives=0;
@@ -58,7 +277,10 @@ public:
     BVHBuildNode(){
         bounds = Bounds3();
         left = nullptr;right = nullptr;
-        object = nullptr;
+    }
+    ~BVHBuildNode(){
+        delete left;
+        delete right;
     }
 };
 
@@ -76,6 +76,7 @@ public:
         return (i == 0) ? pMin : pMax;
     }
 
+    // only the part of the ray between ray.t_min and ray.t_max counts
     inline bool IntersectP(const Ray &ray, const Vector3f &invDir,
                            const std::array<int, 3> &dirisNeg) const;
 };
@@ -107,7 +108,7 @@ inline bool Bounds3::IntersectP(const Ray &ray, const Vector3f &invDir,
     }
     auto t_enter = std::max(tx_min, std::max(ty_min, tz_min));
     auto t_exit = std::min(tx_max, std::min(ty_max, tz_max));
-    return t_enter < t_exit + 1e-4 && t_exit > 0;
+    return t_enter < t_exit + 1e-4 && t_exit > ray.t_min && t_enter <= ray.t_max;
 }
 
 inline Bounds3 Union(const Bounds3 &b1, const Bounds3 &b2) {
@@ -0,0 +1,256 @@
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include "Image.hpp"
+#include "global.hpp"
+
+OutputFile::OutputFile(const std::string &path) : path(path), temp(path + ".tmp")
+{
+    fp = fopen(temp.c_str(), "wb");
+    failed = !fp;
+    buffer.reserve(kBufferSize);
+}
+
+OutputFile::~OutputFile()
+{
+    if (fp) {
+        fclose(fp);
+        std::remove(temp.c_str());
+    }
+}
+
+void OutputFile::write(const void *data, size_t size)
+{
+    written += size;
+    if (buffer.size() + size > kBufferSize)
+        flush();
+    if (size >= kBufferSize) {
+        if (fp && fwrite(data, 1, size, fp) != size)
+            failed = true;
+        return;
+    }
+    buffer.insert(buffer.end(), (const char *)data, (const char *)data + size);
+}
+
+void OutputFile::flush()
+{
+    if (fp && !buffer.empty() && fwrite(buffer.data(), 1, buffer.size(), fp) != buffer.size())
+        failed = true;
+    buffer.clear();
+}
+
+bool OutputFile::commit()
+{
+    flush();
+    if (fp) {
+        failed |= fclose(fp) != 0;
+        fp = nullptr;
+    }
+    if (failed || std::rename(temp.c_str(), path.c_str()) != 0) {
+        std::cerr << "cannot write " << path << "\n";
+        std::remove(temp.c_str());
+        return false;
+    }
+    return true;
+}
+
+namespace {
+bool hasExtension(const std::string &path, const char *extension) {
+    size_t n = strlen(extension);
+    if (path.size() < n)
+        return false;
+    for (size_t i = 0; i < n; ++i)
+        if (tolower(path[path.size() - n + i]) != extension[i])
+            return false;
+    return true;
+}
+
+static_assert(sizeof(Vector3f) == 3 * sizeof(float), "pixels are written as float triples");
+// PFM and EXR data is written in host byte order, and both say little-endian
+// (MSVC only targets little-endian hosts)
+#ifdef __BYTE_ORDER__
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "floats are written little-endian");
+#endif
+
+// Rows are stored bottom first; "-1" marks little-endian floats.
+bool writePFM(const std::string &path, int width, int height, const std::vector<Vector3f> &pixels) {
+    OutputFile file(path);
+    file.print("PF\n" + std::to_string(width) + " " + std::to_string(height) + "\n-1.0\n");
+    for (int y = height - 1; y >= 0; --y)
+        file.write(&pixels[y * width], width * sizeof(Vector3f));
+    return file.commit();
+}
+
+void exrAttribute(OutputFile &file, const char *name, const char *type, int32_t size) {
+    file.write(name, strlen(name) + 1);
+    file.write(type, strlen(type) + 1);
+    file.put(size);
+}
+
+// The smallest OpenEXR file readers accept: one uncompressed scanline per
+// block, channels in alphabetical order, each a row of floats.
+bool writeEXR(const std::string &path, int width, int height, const std::vector<Vector3f> &pixels) {
+    OutputFile file(path);
+    file.put<uint32_t>(20000630);
+    file.put<uint32_t>(2);
+
+    const char *channels[3] = {"B", "G", "R"};
+    exrAttribute(file, "channels", "chlist", 3 * (2 + 16) + 1);
+    for (const char *channel : channels) {
+        file.write(channel, 2);
+        file.put<int32_t>(2); // FLOAT
+        file.put<uint32_t>(0); // pLinear and reserved
+        file.put<int32_t>(1); // x and y sampling
+        file.put<int32_t>(1);
+    }
+    file.put<uint8_t>(0);
+    exrAttribute(file, "compression", "compression", 1);
+    file.put<uint8_t>(0); // NO_COMPRESSION
+    for (const char *window : {"dataWindow", "displayWindow"}) {
+        exrAttribute(file, window, "box2i", 16);
+        int32_t box[4] = {0, 0, width - 1, height - 1};
+        file.write(box, sizeof(box));
+    }
+    exrAttribute(file, "lineOrder", "lineOrder", 1);
+    file.put<uint8_t>(0); // INCREASING_Y
+    exrAttribute(file, "pixelAspectRatio", "float", 4);
+    file.put(1.0f);
+    exrAttribute(file, "screenWindowCenter", "v2f", 8);
+    file.put(0.0f);
+    file.put(0.0f);
+    exrAttribute(file, "screenWindowWidth", "float", 4);
+    file.put(1.0f);
+    file.put<uint8_t>(0);
+
+    int32_t blockSize = 3 * width * sizeof(float);
+    uint64_t offset = file.tell() + height * sizeof(uint64_t);
+    for (int y = 0; y < height; ++y, offset += 8 + blockSize)
+        file.put(offset);
+    std::vector<float> row(3 * width);
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            const Vector3f &pixel = pixels[y * width + x];
+            row[x] = pixel.z;
+            row[width + x] = pixel.y;
+            row[2 * width + x] = pixel.x;
+        }
+        file.put<int32_t>(y);
+        file.put(blockSize);
+        file.write(row.data(), blockSize);
+    }
+    return file.commit();
+}
+
+bool writePPM(const std::string &path, int width, int height, const std::vector<uint8_t> &rgb) {
+    OutputFile file(path);
+    file.print("P6\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n");
+    file.write(rgb.data(), rgb.size());
+    return file.commit();
+}
+
+uint32_t crc32(uint32_t crc, const uint8_t *data, size_t size) {
+    static const std::array<uint32_t, 256> table = [] {
+        std::array<uint32_t, 256> table;
+        for (uint32_t n = 0; n < 256; ++n) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; ++k)
+                c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            table[n] = c;
+        }
+        return table;
+    }();
+    crc = ~crc;
+    for (size_t i = 0; i < size; ++i)
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+void putBigEndian(std::vector<uint8_t> &out, uint32_t v) {
+    for (int shift = 24; shift >= 0; shift -= 8)
+        out.push_back((uint8_t)(v >> shift));
+}
+
+void pngChunk(OutputFile &file, const char *type, const std::vector<uint8_t> &data) {
+    std::vector<uint8_t> chunk;
+    putBigEndian(chunk, (uint32_t)data.size());
+    chunk.insert(chunk.end(), type, type + 4);
+    chunk.insert(chunk.end(), data.begin(), data.end());
+    putBigEndian(chunk, crc32(0, chunk.data() + 4, chunk.size() - 4));
+    file.write(chunk.data(), chunk.size());
+}
+
+// The image data is a zlib stream of stored deflate blocks, one per IDAT
+// chunk: bigger than a compressed PNG, but needs no zlib and costs nothing
+// to produce.
+bool writePNG(const std::string &path, int width, int height, const std::vector<uint8_t> &rgb) {
+    OutputFile file(path);
+    const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    file.write(signature, sizeof(signature));
+
+    std::vector<uint8_t> header;
+    putBigEndian(header, width);
+    putBigEndian(header, height);
+    header.insert(header.end(), {8, 2, 0, 0, 0}); // 8-bit RGB, no interlace
+    pngChunk(file, "IHDR", header);
+
+    // every row starts with its filter type, 0 = none
+    std::vector<uint8_t> raw;
+    raw.reserve((size_t)height * (3 * width + 1));
+    for (int y = 0; y < height; ++y) {
+        raw.push_back(0);
+        raw.insert(raw.end(), rgb.begin() + (size_t)y * 3 * width, rgb.begin() + (size_t)(y + 1) * 3 * width);
+    }
+    uint32_t a = 1, b = 0;
+    for (uint8_t byte : raw) {
+        a = (a + byte) % 65521;
+        b = (b + a) % 65521;
+    }
+
+    std::vector<uint8_t> data = {0x78, 0x01};
+    size_t position = 0;
+    do {
+        size_t size = std::min<size_t>(65535, raw.size() - position);
+        bool last = position + size == raw.size();
+        data.push_back(last);
+        data.insert(data.end(), {(uint8_t)size, (uint8_t)(size >> 8), (uint8_t)~size, (uint8_t)(~size >> 8)});
+        data.insert(data.end(), raw.begin() + position, raw.begin() + position + size);
+        position += size;
+        if (last)
+            putBigEndian(data, (b << 16) | a);
+        pngChunk(file, "IDAT", data);
+        data.clear();
+    } while (position < raw.size());
+    pngChunk(file, "IEND", {});
+    return file.commit();
+}
+}
+
+bool writeImage8(const std::string &path, int width, int height, const std::vector<uint8_t> &rgb)
+{
+    if (hasExtension(path, ".ppm"))
+        return writePPM(path, width, height, rgb);
+    if (hasExtension(path, ".png"))
+        return writePNG(path, width, height, rgb);
+    std::cerr << "unknown 8-bit image format: " << path << "\n";
+    return false;
+}
+
+bool writeImage(const std::string &path, int width, int height, const std::vector<Vector3f> &pixels)
+{
+    if (hasExtension(path, ".pfm"))
+        return writePFM(path, width, height, pixels);
+    if (hasExtension(path, ".exr"))
+        return writeEXR(path, width, height, pixels);
+
+    std::vector<uint8_t> rgb(3 * pixels.size());
+    for (size_t i = 0; i < pixels.size(); ++i) {
+        // a plain 2.2 gamma, close to the sRGB curve
+        float coefficient = 1.0 / 2.2;
+        rgb[3 * i + 0] = (unsigned char) (255 * std::pow(clamp(0, 1, pixels[i].x), coefficient));
+        rgb[3 * i + 1] = (unsigned char) (255 * std::pow(clamp(0, 1, pixels[i].y), coefficient));
+        rgb[3 * i + 2] = (unsigned char) (255 * std::pow(clamp(0, 1, pixels[i].z), coefficient));
+    }
+    return writeImage8(path, width, height, rgb);
+}
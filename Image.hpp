@@ -0,0 +1,56 @@
+#ifndef RAYTRACING_IMAGE_H
+#define RAYTRACING_IMAGE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "Vector.hpp"
+
+// A file written through a large in-memory buffer into a temporary file
+// next to path; commit() renames the temporary over path, so a reader, or
+// a crash, never sees half a file. A file that is not committed is
+// removed.
+class OutputFile {
+public:
+    explicit OutputFile(const std::string &path);
+    ~OutputFile();
+    OutputFile(const OutputFile &) = delete;
+    OutputFile &operator=(const OutputFile &) = delete;
+
+    void write(const void *data, size_t size);
+    // writes v in the machine's byte order
+    template <typename T>
+    void put(const T &v) { write(&v, sizeof(T)); }
+    void print(const std::string &s) { write(s.data(), s.size()); }
+
+    // bytes written so far
+    size_t tell() const { return written; }
+    bool commit();
+
+private:
+    static constexpr size_t kBufferSize = 1 << 20;
+
+    void flush();
+
+    std::string path, temp;
+    FILE *fp;
+    std::vector<char> buffer;
+    size_t written = 0;
+    bool failed = false;
+};
+
+// Writes linear RGB pixels, top row first, in the format the file
+// extension names:
+//   .pfm - 32-bit float RGB, linear
+//   .exr - 32-bit float RGB, linear, uncompressed scanline OpenEXR
+//   .ppm - 8-bit RGB, clamped and gamma encoded
+//   .png - 8-bit RGB, clamped and gamma encoded, stored without compression
+// Returns false, after a message, if the format is unknown or the file
+// cannot be written.
+bool writeImage(const std::string &path, int width, int height, const std::vector<Vector3f> &pixels);
+
+// Writes 8-bit RGB pixels as they are, top row first, to a .ppm or .png.
+bool writeImage8(const std::string &path, int width, int height, const std::vector<uint8_t> &rgb);
+
+#endif //RAYTRACING_IMAGE_H
@@ -0,0 +1,86 @@
+#ifndef RAYTRACING_INSTANCE_H
+#define RAYTRACING_INSTANCE_H
+
+#include "Object.hpp"
+#include "Transform.hpp"
+#include "Triangle.hpp"
+
+// A placement of a MeshTriangle in the scene.
+//
+// The mesh and its BVH (the bottom level) are built once and shared by every
+// instance; an instance only stores its object-to-world transform. The scene
+// BVH over the instances is the top level. Rays are carried into the mesh's
+// own space for traversal and the hit is carried back out, so placing a mesh
+// a thousand times costs a thousand transforms, not a thousand copies.
+class Instance : public Object {
+public:
+    Instance(MeshTriangle *mesh, const Transform &objectToWorld)
+        : mesh(mesh), objectToWorld(objectToWorld),
+          worldToObject(objectToWorld.inverse()) {
+        bounding_box = objectToWorld.bounds(mesh->getBounds());
+        // a non-uniform scale changes every triangle's area differently
+        area = 0;
+        for (uint32_t k = 0; k < mesh->numTriangles; ++k)
+            area += 0.5f * crossProduct(objectToWorld.vector(Vector3f(mesh->e1[0][k], mesh->e1[1][k], mesh->e1[2][k])),
+                                        objectToWorld.vector(Vector3f(mesh->e2[0][k], mesh->e2[1][k], mesh->e2[2][k]))).norm();
+    }
+
+    bool intersect(const Ray &ray) { return mesh->intersect(toObject(ray)); }
+
+    bool intersect(const Ray &ray, float &tnear, uint32_t &index) const {
+        return mesh->intersect(toObject(ray), tnear, index);
+    }
+
+    Intersection getIntersection(const Ray &ray) {
+        Intersection inter = mesh->getIntersection(toObject(ray));
+        if (inter.happened) {
+            // the ray parameter is the same in both spaces
+            inter.coords = ray(inter.distance);
+            inter.normal = normalize(objectToWorld.normal(inter.normal));
+        }
+        return inter;
+    }
+
+    void getSurfaceProperties(const Vector3f &P, const Vector3f &I,
+                              const uint32_t &index, const Vector2f &uv,
+                              Vector3f &N, Vector2f &st) const {
+        mesh->getSurfaceProperties(worldToObject.point(P), worldToObject.vector(I),
+                                   index, uv, N, st);
+        N = normalize(objectToWorld.normal(N));
+    }
+
+    Vector3f evalDiffuseColor(const Vector2f &st) const { return mesh->evalDiffuseColor(st); }
+
+    Bounds3 getBounds() { return bounding_box; }
+
+    float getArea() { return area; }
+
+    bool hasEmit() { return mesh->hasEmit(); }
+
+    void getEmitters(std::vector<Emitter> &emitters) {
+        size_t first = emitters.size();
+        mesh->getEmitters(emitters);
+        for (size_t i = first; i < emitters.size(); ++i) {
+            Emitter &emitter = emitters[i];
+            emitter = Emitter::triangle(objectToWorld.point(emitter.p), objectToWorld.vector(emitter.e1),
+                                        objectToWorld.vector(emitter.e2), emitter.emission);
+        }
+    }
+
+    MeshTriangle *mesh;
+    Transform objectToWorld, worldToObject;
+    Bounds3 bounding_box;
+    float area;
+
+private:
+    // The direction is transformed but not renormalized, which keeps t and
+    // the [t_min, t_max] interval valid in object space.
+    Ray toObject(const Ray &ray) const {
+        Ray local(worldToObject.point(ray.origin), worldToObject.vector(ray.direction), ray.t);
+        local.t_min = ray.t_min;
+        local.t_max = ray.t_max;
+        return local;
+    }
+};
+
+#endif //RAYTRACING_INSTANCE_H
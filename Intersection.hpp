@@ -11,7 +11,7 @@ struct Intersection
         happened=false;
         coords=Vector3f();
         normal=Vector3f();
-        distance= std::numeric_limits<double>::max();
+        distance= std::numeric_limits<float>::max();
         obj =nullptr;
         m=nullptr;
     }
@@ -20,7 +20,7 @@ struct Intersection
     Vector3f tcoords;
     Vector3f normal;    // normal on hit position
     Vector3f emit;      // emission on hit position
-    double distance;    
+    float distance;     
     Object* obj;        // object on hit position
     Material* m;        // material on hit position
 };
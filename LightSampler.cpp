@@ -0,0 +1,77 @@
+#include <algorithm>
+#include <cmath>
+#include "LightSampler.hpp"
+
+Emitter Emitter::triangle(const Vector3f &v0, const Vector3f &e1, const Vector3f &e2,
+                          const Vector3f &emission)
+{
+    return {Shape::Triangle, v0, e1, e2, emission, 0.5f * crossProduct(e1, e2).norm()};
+}
+
+Emitter Emitter::sphere(const Vector3f &center, float radius, const Vector3f &emission)
+{
+    return {Shape::Sphere, center, Vector3f(radius, 0, 0), Vector3f(), emission,
+            4 * M_PI * radius * radius};
+}
+
+// Vose's construction: slots that hold less than the average weight are
+// topped up from one that holds more, until every slot is full.
+void LightSampler::build(std::vector<Emitter> list)
+{
+    emitters.clear();
+    for (const Emitter &emitter : list)
+        if (emitter.area > 0 && luminance(emitter.emission) > 0)
+            emitters.push_back(emitter);
+    size_t n = emitters.size();
+    probability.assign(n, 1.0f);
+    alias.resize(n);
+    totalPower = 0;
+    for (const Emitter &emitter : emitters)
+        totalPower += emitter.area * luminance(emitter.emission);
+
+    std::vector<double> scaled(n);
+    std::vector<uint32_t> small, large;
+    for (size_t i = 0; i < n; ++i) {
+        alias[i] = (uint32_t)i;
+        scaled[i] = (double)emitters[i].area * luminance(emitters[i].emission) * n / totalPower;
+        (scaled[i] < 1 ? small : large).push_back((uint32_t)i);
+    }
+    while (!small.empty() && !large.empty()) {
+        uint32_t s = small.back(), l = large.back();
+        small.pop_back();
+        probability[s] = (float)scaled[s];
+        alias[s] = l;
+        scaled[l] -= 1 - scaled[s];
+        if (scaled[l] < 1) {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+    // what is left over is 1 up to rounding
+}
+
+void LightSampler::sample(Intersection &pos, float &pdf, Sampler &sampler) const
+{
+    if (emitters.empty()) {
+        pdf = 0;
+        return;
+    }
+    float x = sampler.get1D() * emitters.size();
+    uint32_t slot = std::min((uint32_t)x, (uint32_t)emitters.size() - 1);
+    const Emitter &emitter = emitters[x - slot < probability[slot] ? slot : alias[slot]];
+
+    Vector2f u = sampler.get2D();
+    if (emitter.shape == Emitter::Shape::Triangle) {
+        float s = std::sqrt(u.x);
+        pos.coords = emitter.p + emitter.e1 * (s * (1.0f - u.y)) + emitter.e2 * (s * u.y);
+        pos.normal = normalize(crossProduct(emitter.e1, emitter.e2));
+    }
+    else {
+        float z = 1 - 2 * u.x, r = std::sqrt(std::max(0.0f, 1 - z * z)), phi = 2 * M_PI * u.y;
+        pos.normal = Vector3f(r * std::cos(phi), r * std::sin(phi), z);
+        pos.coords = emitter.p + emitter.e1.x * pos.normal;
+    }
+    pos.emit = emitter.emission;
+    pos.happened = true;
+    pdf = this->pdf(emitter.emission);
+}
@@ -0,0 +1,56 @@
+#ifndef RAYTRACING_LIGHTSAMPLER_H
+#define RAYTRACING_LIGHTSAMPLER_H
+
+#include <cstdint>
+#include <vector>
+#include "global.hpp"
+#include "Vector.hpp"
+#include "Intersection.hpp"
+#include "Sampler.hpp"
+
+// One emitting surface in world space, as the light sampler sees it: a
+// triangle given by its first vertex p and the two edges leaving it, or a
+// sphere with center p and radius e1.x.
+struct Emitter {
+    enum class Shape : uint8_t { Triangle, Sphere };
+
+    static Emitter triangle(const Vector3f &v0, const Vector3f &e1, const Vector3f &e2,
+                            const Vector3f &emission);
+    static Emitter sphere(const Vector3f &center, float radius, const Vector3f &emission);
+
+    Shape shape;
+    Vector3f p, e1, e2;
+    Vector3f emission;
+    float area;
+};
+
+// Picks points on the emitters of a scene in O(1).
+//
+// Every emitter is flattened into one array when the scene is built, and a
+// Walker alias table chooses among them with probability proportional to
+// area times emitted luminance; the point is then uniform over the chosen
+// surface. The pdf per unit area of a point is thus its own luminance over
+// the total emitted power, which needs nothing but the emission to evaluate.
+class LightSampler {
+public:
+    void build(std::vector<Emitter> emitters);
+    bool empty() const { return emitters.empty(); }
+
+    // Sets pos.coords, pos.normal and pos.emit to a point on an emitter and
+    // pdf to its density per unit area.
+    void sample(Intersection &pos, float &pdf, Sampler &sampler) const;
+    // density per unit area with which sample picks a point emitting emit
+    float pdf(const Vector3f &emit) const { return totalPower > 0 ? luminance(emit) / totalPower : 0.0f; }
+
+    static float luminance(const Vector3f &c) { return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z; }
+
+private:
+    std::vector<Emitter> emitters;
+    // alias table: slot i keeps emitter i with probability probability[i]
+    // and otherwise hands over to emitter alias[i]
+    std::vector<float> probability;
+    std::vector<uint32_t> alias;
+    float totalPower = 0;
+};
+
+#endif //RAYTRACING_LIGHTSAMPLER_H
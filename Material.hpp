@@ -2,8 +2,24 @@
 #define RAYTRACING_MATERIAL_H
 
 #include "Vector.hpp"
+#include "Sampler.hpp"
 
-enum MaterialType { DIFFUSE, GLASS, SPECULAR};
+// GLOSSY: Lambertian Kd plus a GGX microfacet reflection lobe with Schlick
+// Fresnel from Ks, the rough conductor of the .mtl Phong model.
+// ROUGH_GLASS: GGX microfacet dielectric with index of refraction ior.
+// Both take their GGX alpha from roughness.
+enum MaterialType { DIFFUSE, GLASS, SPECULAR, GLOSSY, ROUGH_GLASS};
+constexpr int kNumMaterialTypes = ROUGH_GLASS + 1;
+
+// A direction sampled from a BSDF, with what the path needs to follow it.
+struct BSDFSample {
+    Vector3f wi;
+    // BSDF * |cos(theta_i)| / pdf, the factor the path throughput takes on
+    Vector3f weight;
+    // solid angle pdf of wi; 0 for specular samples, which have no density
+    float pdf;
+    bool specular;
+};
 
 class Material{
 private:
@@ -67,27 +83,136 @@ private:
         // kt = 1 - kr;
     }
 
-    Vector3f toWorld(const Vector3f &a, const Vector3f &N){
+    // Orthonormal basis around N without branches or square roots (Duff et
+    // al., "Building an Orthonormal Basis, Revisited", JCGT 2017).
+    static void basis(const Vector3f &N, Vector3f &B, Vector3f &C){
+        float sign = std::copysign(1.0f, N.z);
+        float p = -1.0f / (sign + N.z);
+        float q = N.x * N.y * p;
+        B = Vector3f(1.0f + sign * N.x * N.x * p, sign * q, -sign * N.x);
+        C = Vector3f(q, sign + N.y * N.y * p, -N.y);
+    }
+
+    static Vector3f toWorld(const Vector3f &a, const Vector3f &N){
         Vector3f B, C;
-        if (std::fabs(N.x) > std::fabs(N.y)){
-            float invLen = 1.0f / std::sqrt(N.x * N.x + N.z * N.z);
-            C = Vector3f(N.z * invLen, 0.0f, -N.x *invLen);
-        }
-        else {
-            float invLen = 1.0f / std::sqrt(N.y * N.y + N.z * N.z);
-            C = Vector3f(0.0f, N.z * invLen, -N.y *invLen);
-        }
-        B = crossProduct(C, N);
+        basis(N, B, C);
         return a.x * B + a.y * C + a.z * N;
     }
 
+    static Vector3f toLocal(const Vector3f &v, const Vector3f &N){
+        Vector3f B, C;
+        basis(N, B, C);
+        return Vector3f(dotProduct(v, B), dotProduct(v, C), dotProduct(v, N));
+    }
+
+    // cosine-weighted direction around +z (Malley's method): uniform on the
+    // unit disk, projected up
+    static Vector3f cosineHemisphere(const Vector2f &u){
+        float r = std::sqrt(u.x), phi = 2 * M_PI * u.y;
+        return Vector3f(r * std::cos(phi), r * std::sin(phi), std::sqrt(std::max(0.0f, 1.0f - u.x)));
+    }
+
+    // The GGX helpers work in the local frame, where the macro normal is +z.
+
+    // GGX distribution of microfacet normals m
+    static float ggxD(const Vector3f &m, float alpha){
+        float a2 = alpha * alpha;
+        float d = m.z * m.z * (a2 - 1) + 1;
+        return a2 / (M_PI * d * d);
+    }
+
+    // Smith's Lambda for GGX; v may lie on either side
+    static float ggxLambda(const Vector3f &v, float alpha){
+        float cos2 = v.z * v.z;
+        float tan2 = std::max(0.0f, 1 - cos2) / cos2;
+        return 0.5f * (std::sqrt(1 + alpha * alpha * tan2) - 1);
+    }
+
+    static float ggxG1(const Vector3f &v, float alpha){
+        return 1 / (1 + ggxLambda(v, alpha));
+    }
+
+    // height-correlated masking-shadowing
+    static float ggxG2(const Vector3f &wo, const Vector3f &wi, float alpha){
+        return 1 / (1 + ggxLambda(wo, alpha) + ggxLambda(wi, alpha));
+    }
+
+    // pdf of the microfacet normal m among those visible from wo (wo.z > 0)
+    static float ggxVisiblePdf(const Vector3f &wo, const Vector3f &m, float alpha){
+        return ggxG1(wo, alpha) * std::max(0.0f, dotProduct(wo, m)) * ggxD(m, alpha) / wo.z;
+    }
+
+    // Samples a microfacet normal visible from wo (wo.z > 0) with the
+    // distribution of visible normals (Heitz, "Sampling the GGX Distribution
+    // of Visible Normals", JCGT 2018): uniform on the projected hemisphere
+    // of the stretched configuration, then unstretched. Every normal
+    // returned faces wo, and the weight G2 / G1 of the bounce stays close
+    // to 1.
+    static Vector3f ggxSampleVisible(const Vector3f &wo, float alpha, const Vector2f &u){
+        Vector3f Vh = normalize(Vector3f(alpha * wo.x, alpha * wo.y, wo.z));
+        float lensq = Vh.x * Vh.x + Vh.y * Vh.y;
+        Vector3f T1 = lensq > 0 ? Vector3f(-Vh.y, Vh.x, 0) / std::sqrt(lensq) : Vector3f(1, 0, 0);
+        Vector3f T2 = crossProduct(Vh, T1);
+        float r = std::sqrt(u.x), phi = 2 * M_PI * u.y;
+        float t1 = r * std::cos(phi), t2 = r * std::sin(phi);
+        float s = 0.5f * (1 + Vh.z);
+        t2 = (1 - s) * std::sqrt(std::max(0.0f, 1 - t1 * t1)) + s * t2;
+        Vector3f Nh = t1 * T1 + t2 * T2 + std::sqrt(std::max(0.0f, 1 - t1 * t1 - t2 * t2)) * Vh;
+        return normalize(Vector3f(alpha * Nh.x, alpha * Nh.y, std::max(1e-6f, Nh.z)));
+    }
+
+    static Vector3f schlick(const Vector3f &F0, float cosTheta){
+        float c = 1 - clamp(0, 1, cosTheta);
+        float c2 = c * c;
+        return F0 + (Vector3f(1.0f) - F0) * (c2 * c2 * c);
+    }
+
+    // Fresnel reflectance of a dielectric for light arriving at cosi > 0
+    // from the side with the lower index, eta = n_t / n_i
+    static float fresnelDielectric(float cosi, float eta){
+        float sin2t = (1 - cosi * cosi) / (eta * eta);
+        if (sin2t >= 1)
+            return 1;
+        float cost = std::sqrt(1 - sin2t);
+        float rs = (cosi - eta * cost) / (cosi + eta * cost);
+        float rp = (eta * cosi - cost) / (eta * cosi + cost);
+        return 0.5f * (rs * rs + rp * rp);
+    }
+
+    static float luminance(const Vector3f &c){
+        return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+    }
+
+    // GLOSSY: probability of sampling the microfacet lobe
+    float glossyLobeProbability() const {
+        float d = luminance(Kd), s = luminance(Ks);
+        return d + s > 0 ? s / (d + s) : 0.0f;
+    }
+
+    // ROUGH_GLASS works with wo above the surface: a path inside the
+    // material sees the frame and the relative index flipped
+    float orient(Vector3f &wo, Vector3f &wi) const {
+        if (wo.z >= 0)
+            return ior;
+        wo.z = -wo.z;
+        wi.z = -wi.z;
+        return 1 / ior;
+    }
+
+    inline float glossyPdf(const Vector3f &wo, const Vector3f &wi) const;
+    inline Vector3f glossyEval(const Vector3f &wo, const Vector3f &wi) const;
+    inline float roughGlassPdf(Vector3f wo, Vector3f wi) const;
+    inline Vector3f roughGlassEval(Vector3f wo, Vector3f wi) const;
+
 public:
     MaterialType m_type;
     //Vector3f m_color;
     Vector3f m_emission;
-    float ior;
+    float ior = 1.5f;
     Vector3f Kd, Ks;
-    float specularExponent;
+    float specularExponent = 0;
+    // GGX alpha of GLOSSY and ROUGH_GLASS
+    float roughness = 0.1f;
     //Texture tex;
 
     inline Material(MaterialType t=DIFFUSE, Vector3f e=Vector3f(0,0,0));
@@ -96,13 +221,24 @@ public:
     inline Vector3f getColorAt(double u, double v);
     inline Vector3f getEmission();
     inline bool hasEmission();
+    // whether the material scatters only into single directions (mirror,
+    // glass): such a BSDF cannot be evaluated, only sampled, and light
+    // sampling does not apply to it
+    bool isSpecular() const { return m_type == GLASS || m_type == SPECULAR; }
+    // whether light passes through; the normal then tells inside from outside
+    bool transmits() const { return m_type == GLASS || m_type == ROUGH_GLASS; }
+
+    // In the BSDF methods, N is the shading normal, wo the unit direction
+    // towards the viewer and wi the unit direction towards the light, both
+    // pointing away from the surface.
 
-    // sample a ray by Material properties
-    inline Vector3f sample(const Vector3f &wi, const Vector3f &N);
-    // given a ray, calculate the PdF of this ray
-    inline float pdf(const Vector3f &wi, const Vector3f &wo, const Vector3f &N);
-    // given a ray, calculate the contribution of this ray
-    inline Vector3f eval(const Vector3f &wi, const Vector3f &wo, const Vector3f &N);
+    // Samples wi for the given wo. Returns false if the material scatters
+    // no light from wo.
+    inline bool sample(const Vector3f &wo, const Vector3f &N, Sampler &sampler, BSDFSample &bs);
+    // solid angle pdf with which sample picks wi; 0 for specular materials
+    inline float pdf(const Vector3f &wo, const Vector3f &wi, const Vector3f &N);
+    // BSDF value for the pair of directions; 0 for specular materials
+    inline Vector3f eval(const Vector3f &wo, const Vector3f &wi, const Vector3f &N);
 
 };
 
@@ -124,69 +260,183 @@ Vector3f Material::getColorAt(double u, double v) {
     return Vector3f();
 }
 
-Vector3f Material::sample(const Vector3f &wi, const Vector3f &N){
+bool Material::sample(const Vector3f &wo, const Vector3f &N, Sampler &sampler, BSDFSample &bs){
     switch(m_type){
         case DIFFUSE:
         {
-            // uniform sample on the hemisphere
-            float x_1 = get_random_float(), x_2 = get_random_float();
-            float z = std::fabs(1.0f - 2.0f * x_1);
-            float r = std::sqrt(1.0f - z * z), phi = 2 * M_PI * x_2;
-            Vector3f localRay(r*std::cos(phi), r*std::sin(phi), z);
-            return toWorld(localRay, N);
-            
-            break;
+            // cosine-weighted sample on the hemisphere; f * cos / pdf = Kd
+            Vector3f i = cosineHemisphere(sampler.get2D());
+            bs.wi = toWorld(i, N);
+            bs.pdf = i.z / M_PI;
+            bs.weight = Kd;
+            bs.specular = false;
+            return bs.pdf > 0.0f;
         }
         case SPECULAR:
         {
-            return reflect(wi, N);
+            // perfect mirror, scaled by the Fresnel reflectance
+            float kr;
+            fresnel(-wo, N, ior, kr);
+            bs.wi = reflect(-wo, N);
+            bs.pdf = 0.0f;
+            bs.weight = Vector3f(kr);
+            bs.specular = true;
+            return true;
         }
-    }
-}
-
-float Material::pdf(const Vector3f &wi, const Vector3f &wo, const Vector3f &N){
-    switch(m_type){
-        case DIFFUSE:
+        case GLOSSY:
         {
-            // uniform sample probability 1 / (2 * PI)
-            if (dotProduct(wo, N) > 0.0f)
-                return 0.5f / M_PI;
+            Vector3f o = toLocal(wo, N);
+            if (o.z <= 0.0f)
+                return false;
+            float pGlossy = glossyLobeProbability();
+            Vector3f i;
+            if (sampler.get1D() < pGlossy) {
+                Vector3f m = ggxSampleVisible(o, roughness, sampler.get2D());
+                i = 2 * dotProduct(o, m) * m - o;
+            }
             else
-                return 0.0f;
-            break;
+                i = cosineHemisphere(sampler.get2D());
+            if (i.z <= 0.0f)
+                return false;
+            // one-sample MIS over the two lobes: the pdf and weight are
+            // those of the mixture
+            bs.wi = toWorld(i, N);
+            bs.pdf = glossyPdf(o, i);
+            bs.weight = glossyEval(o, i) * (i.z / bs.pdf);
+            bs.specular = false;
+            return bs.pdf > 0.0f;
         }
-        case SPECULAR:
-        {
-            float angle_1 = dotProduct(N, wo);
-            float angle_2 = dotProduct(N, wi);
-            if (angle_1 == angle_2) return 1;
-            else return 0;
-        }
-    }
-}
-
-Vector3f Material::eval(const Vector3f &wi, const Vector3f &wo, const Vector3f &N){
-    switch(m_type){
-        case DIFFUSE:
+        case ROUGH_GLASS:
         {
-            // calculate the contribution of diffuse   model
-            float cosalpha = dotProduct(N, wo);
-            if (cosalpha > 0.0f) {
-                Vector3f diffuse = Kd / M_PI;
-                return diffuse;
+            Vector3f local = toLocal(wo, N), o = local, unused;
+            float eta = orient(o, unused);
+            Vector3f m = ggxSampleVisible(o, roughness, sampler.get2D());
+            float cosi = dotProduct(o, m);
+            float F = fresnelDielectric(cosi, eta);
+            Vector3f i;
+            if (sampler.get1D() < F) {
+                i = 2 * cosi * m - o;
+                if (i.z <= 0.0f)
+                    return false;
             }
-            else
-                return Vector3f(0.0f);
-            break;
+            else {
+                float cost = std::sqrt(std::max(0.0f, 1 - (1 - cosi * cosi) / (eta * eta)));
+                i = -o / eta + (cosi / eta - cost) * m;
+                if (i.z >= 0.0f)
+                    return false;
+            }
+            // with the visible normals sampled, F or 1 - F and the
+            // distribution cancel out of the weight, leaving G2 / G1
+            bs.weight = Vector3f(ggxG2(o, i, roughness) / ggxG1(o, roughness));
+            if (local.z < 0)
+                i.z = -i.z;
+            bs.pdf = roughGlassPdf(local, i);
+            bs.wi = normalize(toWorld(i, N));
+            bs.specular = false;
+            return bs.pdf > 0.0f;
         }
-        case SPECULAR:
+        default:
         {
-            float angle_1 = dotProduct(N, wo);
-            float angle_2 = dotProduct(N, wi);
-            if (angle_1 == angle_2) return Kd;
-            else return Vector3f(0.0f);
+            // GLASS: reflect with probability kr and refract otherwise; the
+            // weights kr and 1 - kr cancel
+            float kr;
+            fresnel(-wo, N, ior, kr);
+            bs.wi = sampler.get1D() < kr ? normalize(reflect(-wo, N))
+                                         : normalize(refract(-wo, N, ior));
+            bs.pdf = 0.0f;
+            bs.weight = Vector3f(1.0f);
+            bs.specular = true;
+            return true;
         }
     }
 }
 
+float Material::pdf(const Vector3f &wo, const Vector3f &wi, const Vector3f &N){
+    if (m_type == GLOSSY)
+        return glossyPdf(toLocal(wo, N), toLocal(wi, N));
+    if (m_type == ROUGH_GLASS)
+        return roughGlassPdf(toLocal(wo, N), toLocal(wi, N));
+    if (m_type != DIFFUSE)
+        return 0.0f;
+    // cosine-weighted sampling: cos(theta) / PI
+    return std::max(0.0f, dotProduct(wi, N)) / M_PI;
+}
+
+Vector3f Material::eval(const Vector3f &wo, const Vector3f &wi, const Vector3f &N){
+    if (m_type == GLOSSY)
+        return glossyEval(toLocal(wo, N), toLocal(wi, N));
+    if (m_type == ROUGH_GLASS)
+        return roughGlassEval(toLocal(wo, N), toLocal(wi, N));
+    if (m_type != DIFFUSE)
+        return Vector3f(0.0f);
+    // calculate the contribution of diffuse   model
+    float cosalpha = dotProduct(N, wi);
+    if (cosalpha > 0.0f) {
+        Vector3f diffuse = Kd / M_PI;
+        return diffuse;
+    }
+    else
+        return Vector3f(0.0f);
+}
+
+float Material::glossyPdf(const Vector3f &wo, const Vector3f &wi) const {
+    if (wo.z <= 0.0f || wi.z <= 0.0f)
+        return 0.0f;
+    Vector3f m = normalize(wo + wi);
+    float pGlossy = glossyLobeProbability();
+    return (1 - pGlossy) * wi.z / M_PI +
+           pGlossy * ggxVisiblePdf(wo, m, roughness) / (4 * dotProduct(wo, m));
+}
+
+Vector3f Material::glossyEval(const Vector3f &wo, const Vector3f &wi) const {
+    if (wo.z <= 0.0f || wi.z <= 0.0f)
+        return Vector3f(0.0f);
+    Vector3f m = normalize(wo + wi);
+    float specular = ggxD(m, roughness) * ggxG2(wo, wi, roughness) / (4 * wo.z * wi.z);
+    return Kd / M_PI + schlick(Ks, dotProduct(wo, m)) * specular;
+}
+
+// Walter et al., "Microfacet Models for Refraction through Rough Surfaces"
+// (EGSR 2007), with the generalized half vector wo + eta * wi for
+// transmission. Radiance is not scaled by 1 / eta^2 on refraction, as with
+// GLASS; the factors cancel for paths that enter and leave a closed object.
+float Material::roughGlassPdf(Vector3f wo, Vector3f wi) const {
+    float eta = orient(wo, wi);
+    if (wo.z == 0.0f || wi.z == 0.0f)
+        return 0.0f;
+    bool reflection = wi.z > 0;
+    Vector3f m = reflection ? normalize(wo + wi) : normalize(wo + eta * wi);
+    if (m.z < 0)
+        m = -m;
+    float cosO = dotProduct(wo, m), cosI = dotProduct(wi, m);
+    // microfacets facing away from either direction do not scatter
+    if (cosO <= 0.0f || (reflection ? cosI <= 0.0f : cosI >= 0.0f))
+        return 0.0f;
+    float F = fresnelDielectric(cosO, eta);
+    float pdfM = ggxVisiblePdf(wo, m, roughness);
+    if (reflection)
+        return F * pdfM / (4 * cosO);
+    float denom = cosI + cosO / eta;
+    return (1 - F) * pdfM * std::fabs(cosI) / (denom * denom);
+}
+
+Vector3f Material::roughGlassEval(Vector3f wo, Vector3f wi) const {
+    float eta = orient(wo, wi);
+    if (wo.z == 0.0f || wi.z == 0.0f)
+        return Vector3f(0.0f);
+    bool reflection = wi.z > 0;
+    Vector3f m = reflection ? normalize(wo + wi) : normalize(wo + eta * wi);
+    if (m.z < 0)
+        m = -m;
+    float cosO = dotProduct(wo, m), cosI = dotProduct(wi, m);
+    if (cosO <= 0.0f || (reflection ? cosI <= 0.0f : cosI >= 0.0f))
+        return Vector3f(0.0f);
+    float F = fresnelDielectric(cosO, eta);
+    float DG = ggxD(m, roughness) * ggxG2(wo, wi, roughness);
+    if (reflection)
+        return Vector3f(F * DG / (4 * wo.z * wi.z));
+    float denom = cosI + cosO / eta;
+    return Vector3f((1 - F) * DG * std::fabs(cosI * cosO / (wo.z * wi.z * denom * denom)));
+}
+
 #endif //RAYTRACING_MATERIAL_H
@@ -0,0 +1,261 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include "Image.hpp"
+#include "MappedFile.hpp"
+#include "MeshCache.hpp"
+#include "ThreadPool.hpp"
+#include "Triangle.hpp"
+
+std::string meshCacheDirectory = "cache";
+
+namespace {
+// bump whenever the layout below or what the build produces changes
+constexpr uint32_t kFormatVersion = 3;
+// files are hashed in blocks of this size, in parallel
+constexpr size_t kHashBlockSize = 4 << 20;
+
+uint64_t rotateLeft(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+uint64_t finalize(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+// hash of a file's content, or 0 if it cannot be read
+uint64_t hashFile(const std::string &path) {
+    MappedFile file(path);
+    if (!file.ok)
+        return 0;
+    size_t numBlocks = (file.size + kHashBlockSize - 1) / kHashBlockSize;
+    std::vector<uint64_t> blocks(numBlocks);
+    auto hashBlock = [&](int i) {
+        size_t begin = (size_t)i * kHashBlockSize;
+        blocks[i] = hashBytes(file.data + begin, std::min(kHashBlockSize, file.size - begin));
+    };
+    if (numBlocks > 1)
+        ThreadPool::get().parallelFor((int)numBlocks, hashBlock);
+    else if (numBlocks == 1)
+        hashBlock(0);
+    return hashBytes(blocks.data(), blocks.size() * sizeof(uint64_t), file.size) | 1;
+}
+
+struct MeshCacheHeader {
+    char magic[8];
+    uint64_t key;
+    uint32_t numVertices, numTriangles, numNodes, numMaterials, numDependencies;
+    float area;
+    Vector3f bounds[2], worldBound[2];
+};
+
+const char kMagic[8] = "RTMESH1";
+
+// Bounds-checked reads from a mapped cache file.
+struct Reader {
+    const char *p, *end;
+
+    bool read(void *out, size_t size) {
+        if ((size_t)(end - p) < size)
+            return false;
+        std::memcpy(out, p, size);
+        p += size;
+        return true;
+    }
+    template <typename T>
+    bool get(T &v) { return read(&v, sizeof(T)); }
+    template <typename T>
+    bool get(std::vector<T> &v, size_t n) {
+        if ((size_t)(end - p) / sizeof(T) < n)
+            return false;
+        v.resize(n);
+        return read(v.data(), n * sizeof(T));
+    }
+    bool get(std::string &s) {
+        uint32_t n;
+        if (!get(n) || (size_t)(end - p) < n)
+            return false;
+        s.assign(p, n);
+        p += n;
+        return true;
+    }
+};
+
+void putString(OutputFile &file, const std::string &s) {
+    file.put((uint32_t)s.size());
+    file.print(s);
+}
+
+template <typename T>
+void putArray(OutputFile &file, const std::vector<T> &v, size_t n) {
+    file.write(v.data(), n * sizeof(T));
+}
+}
+
+uint64_t hashBytes(const void *data, size_t size, uint64_t seed)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    uint64_t h = seed ^ (size * 0x9E3779B97F4A7C15ULL);
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t w;
+        std::memcpy(&w, p + i, 8);
+        h = rotateLeft(h ^ (w * 0x87c37b91114253d5ULL), 31) * 0x4cf5ad432745937fULL;
+    }
+    uint64_t tail = 0;
+    for (int shift = 0; i < size; ++i, shift += 8)
+        tail |= (uint64_t)p[i] << shift;
+    h = rotateLeft(h ^ (tail * 0x87c37b91114253d5ULL), 31) * 0x4cf5ad432745937fULL;
+    return finalize(h);
+}
+
+MeshCache::MeshCache(const std::string &objPath, BVHAccel::SplitMethod splitMethod, int maxPrimsInNode)
+    : splitMethod(splitMethod), maxPrimsInNode(maxPrimsInNode)
+{
+    if (meshCacheDirectory.empty())
+        return;
+    uint64_t content = hashFile(objPath);
+    if (!content)
+        return;
+    uint32_t settings[] = {kFormatVersion, (uint32_t)splitMethod, (uint32_t)maxPrimsInNode,
+                           (uint32_t)WideBVHNode::kWidth, (uint32_t)sizeof(WideBVHNode)};
+    key = hashBytes(settings, sizeof(settings), content);
+
+    size_t slash = objPath.find_last_of("/\\");
+    std::string name = objPath.substr(slash == std::string::npos ? 0 : slash + 1);
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)key);
+    path = meshCacheDirectory + "/" + name + "-" + hex + ".rtmesh";
+}
+
+bool MeshCache::load(MeshTriangle &mesh, std::vector<ObjMaterial> &materials) const
+{
+    if (!enabled())
+        return false;
+    MappedFile file(path);
+    if (!file.ok || !file.data)
+        return false;
+    Reader in{file.data, file.data + file.size};
+    MeshCacheHeader header;
+    if (!in.get(header) || std::memcmp(header.magic, kMagic, sizeof(kMagic)) || header.key != key)
+        return false;
+
+    uint32_t n = header.numTriangles;
+    std::vector<WideBVHNode> nodes;
+    bool ok = in.get(mesh.vertices, header.numVertices) && in.get(mesh.vertexIndex, 3 * (size_t)n);
+    for (int axis = 0; axis < 3; ++axis)
+        ok = ok && in.get(mesh.v0[axis], n) && in.get(mesh.e1[axis], n) && in.get(mesh.e2[axis], n);
+    ok = ok && in.get(mesh.materialIds, n) && in.get(nodes, header.numNodes);
+    materials.resize(ok ? header.numMaterials : 0);
+    for (ObjMaterial &material : materials) {
+        ok = ok && in.get(material.name) && in.get(material.Kd) && in.get(material.Ks) && in.get(material.Ke) &&
+             in.get(material.Ns) && in.get(material.Ni) && in.get(material.d) && in.get(material.illum);
+    }
+    // a changed .mtl file makes the cache stale as well
+    for (uint32_t k = 0; ok && k < header.numDependencies; ++k) {
+        std::string dependency;
+        uint64_t hash;
+        ok = in.get(dependency) && in.get(hash) && hashFile(dependency) == hash;
+    }
+    if (!ok || in.p != in.end)
+        return false;
+
+    // a damaged file must not send traversal out of the arrays
+    for (uint32_t index : mesh.vertexIndex)
+        if (index >= header.numVertices)
+            return false;
+    // nor loop or nest deeper than the traversal stacks allow: the builds
+    // lay children out after their parent, so that is all a file may hold
+    std::vector<int> depth(header.numNodes, 1);
+    for (uint32_t k = 0; k < header.numNodes; ++k) {
+        const WideBVHNode &node = nodes[k];
+        if (node.numChildren < 0 || node.numChildren > WideBVHNode::kWidth)
+            return false;
+        for (int i = 0; i < node.numChildren; ++i) {
+            bool leaf = node.nPrimitives[i] > 0;
+            if (node.child[i] < 0 || (leaf ? (uint32_t)node.child[i] + node.nPrimitives[i] > n
+                                           : (uint32_t)node.child[i] <= k ||
+                                             (uint32_t)node.child[i] >= header.numNodes))
+                return false;
+            if (!leaf) {
+                int &childDepth = depth[node.child[i]];
+                childDepth = std::max(childDepth, depth[k] + 1);
+                if (childDepth > kMaxBVHDepth)
+                    return false;
+            }
+        }
+    }
+    for (uint32_t id : mesh.materialIds)
+        if (id != ObjMesh::kNoMaterial && id >= header.numMaterials)
+            return false;
+
+    mesh.numTriangles = n;
+    for (int axis = 0; axis < 3; ++axis) {
+        mesh.v0[axis].resize(n + kTrianglePadding);
+        mesh.e1[axis].resize(n + kTrianglePadding);
+        mesh.e2[axis].resize(n + kTrianglePadding);
+    }
+    mesh.bounding_box = Bounds3(header.bounds[0], header.bounds[1]);
+    mesh.area = header.area;
+    mesh.bvh = new BVHAccel(std::move(nodes), Bounds3(header.worldBound[0], header.worldBound[1]),
+                            maxPrimsInNode, splitMethod);
+    return true;
+}
+
+void MeshCache::save(const MeshTriangle &mesh, const std::vector<ObjMaterial> &materials,
+                     const std::vector<std::string> &dependencies) const
+{
+    if (!enabled())
+        return;
+    if (mkdir(meshCacheDirectory.c_str(), 0755) != 0 && errno != EEXIST) {
+        std::cerr << "cannot create " << meshCacheDirectory << "\n";
+        return;
+    }
+    const BVHAccel &bvh = *mesh.bvh;
+    // zeroed, so the padding is written the same every time
+    MeshCacheHeader header{};
+    std::memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.key = key;
+    header.numVertices = (uint32_t)mesh.vertices.size();
+    header.numTriangles = mesh.numTriangles;
+    header.numNodes = (uint32_t)bvh.nodes.size();
+    header.numMaterials = (uint32_t)materials.size();
+    header.numDependencies = (uint32_t)dependencies.size();
+    header.area = mesh.area;
+    header.bounds[0] = mesh.bounding_box.pMin;
+    header.bounds[1] = mesh.bounding_box.pMax;
+    header.worldBound[0] = bvh.worldBound.pMin;
+    header.worldBound[1] = bvh.worldBound.pMax;
+
+    OutputFile file(path);
+    file.put(header);
+    putArray(file, mesh.vertices, mesh.vertices.size());
+    putArray(file, mesh.vertexIndex, mesh.vertexIndex.size());
+    for (int axis = 0; axis < 3; ++axis) {
+        putArray(file, mesh.v0[axis], mesh.numTriangles);
+        putArray(file, mesh.e1[axis], mesh.numTriangles);
+        putArray(file, mesh.e2[axis], mesh.numTriangles);
+    }
+    putArray(file, mesh.materialIds, mesh.numTriangles);
+    putArray(file, bvh.nodes, bvh.nodes.size());
+    for (const ObjMaterial &material : materials) {
+        putString(file, material.name);
+        file.put(material.Kd);
+        file.put(material.Ks);
+        file.put(material.Ke);
+        file.put(material.Ns);
+        file.put(material.Ni);
+        file.put(material.d);
+        file.put(material.illum);
+    }
+    for (const std::string &dependency : dependencies) {
+        putString(file, dependency);
+        file.put(hashFile(dependency));
+    }
+    file.commit();
+}
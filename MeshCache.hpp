@@ -0,0 +1,46 @@
+#ifndef RAYTRACING_MESHCACHE_H
+#define RAYTRACING_MESHCACHE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "BVH.hpp"
+#include "ObjParser.hpp"
+
+class MeshTriangle;
+
+// Directory the mesh caches go to; empty turns caching off.
+extern std::string meshCacheDirectory;
+
+// 64-bit hash of a byte range, for cache keys; not cryptographic.
+uint64_t hashBytes(const void *data, size_t size, uint64_t seed = 0);
+
+// Binary cache of a MeshTriangle built from an OBJ file: its vertex and
+// index buffers, the per-triangle arrays the kernels read, the triangles'
+// material ids and the flattened BVH, together with the materials of its
+// .mtl files. The file is named after
+// a hash of the OBJ file's content and of everything the build depends on
+// (format version, split method, leaf size), so any change to those misses
+// the cache. The .mtl files are hashed into the cache as well and checked
+// when it is loaded.
+class MeshCache {
+public:
+    MeshCache(const std::string &objPath, BVHAccel::SplitMethod splitMethod, int maxPrimsInNode);
+
+    bool enabled() const { return !path.empty(); }
+    // Fills mesh, with the material ids of its triangles, and the materials
+    // those refer to from the cache; false if there is none or it is stale
+    // or damaged.
+    bool load(MeshTriangle &mesh, std::vector<ObjMaterial> &materials) const;
+    // Writes the cache; failures only cost the next run a rebuild.
+    void save(const MeshTriangle &mesh, const std::vector<ObjMaterial> &materials,
+              const std::vector<std::string> &dependencies) const;
+
+private:
+    std::string path;
+    uint64_t key = 0;
+    BVHAccel::SplitMethod splitMethod;
+    int maxPrimsInNode;
+};
+
+#endif //RAYTRACING_MESHCACHE_H
@@ -0,0 +1,278 @@
+#include <algorithm>
+#include <cfloat>
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <string_view>
+#include <unordered_map>
+#include "MappedFile.hpp"
+#include "ObjParser.hpp"
+#include "ThreadPool.hpp"
+
+namespace {
+// Smallest piece of a file one task parses; smaller files are read on the
+// calling thread alone.
+constexpr size_t kMinChunkSize = 256 << 10;
+
+// '\r' counts as a blank, so CRLF files read like LF ones
+bool isBlank(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+void skipBlanks(const char *&p, const char *end) {
+    while (p < end && isBlank(*p))
+        ++p;
+}
+
+const char *lineEnd(const char *p, const char *end) {
+    const char *q = (const char *)memchr(p, '\n', end - p);
+    return q ? q : end;
+}
+
+std::string_view token(const char *&p, const char *end) {
+    skipBlanks(p, end);
+    const char *begin = p;
+    while (p < end && !isBlank(*p))
+        ++p;
+    return {begin, (size_t)(p - begin)};
+}
+
+// the rest of the line without surrounding blanks, for names that may hold
+// spaces
+std::string_view rest(const char *p, const char *end) {
+    skipBlanks(p, end);
+    while (end > p && isBlank(end[-1]))
+        --end;
+    return {p, (size_t)(end - p)};
+}
+
+bool parseFloat(const char *&p, const char *end, float &f) {
+    skipBlanks(p, end);
+    if (p < end && *p == '+')
+        ++p;
+    auto result = std::from_chars(p, end, f);
+    if (result.ec == std::errc::result_out_of_range) {
+        // too small for a float rounds to zero; too large is an error
+        double d;
+        result = std::from_chars(p, end, d);
+        if (result.ec != std::errc() || std::fabs(d) > FLT_MAX)
+            return false;
+        f = (float)d;
+    }
+    else if (result.ec != std::errc())
+        return false;
+    p = result.ptr;
+    return true;
+}
+
+bool parseVector(const char *&p, const char *end, Vector3f &v) {
+    return parseFloat(p, end, v.x) && parseFloat(p, end, v.y) && parseFloat(p, end, v.z);
+}
+
+// What one task gathers from its part of the file. Indices are final except
+// for the entries listed in relative, which count from the chunk's first
+// vertex because the face gave them relative to the end of the list.
+struct Chunk {
+    const char *begin, *end;
+    std::vector<Vector3f> positions;
+    std::vector<uint32_t> indices;
+    std::vector<uint32_t> relative;
+    // first triangle and name of every usemtl
+    std::vector<std::pair<uint32_t, std::string_view>> usemtl;
+    std::vector<std::string_view> mtllib;
+    // first line that could not be read
+    std::string_view badLine;
+};
+
+void parseChunk(Chunk &chunk) {
+    std::vector<int64_t> corners;
+    for (const char *line = chunk.begin; line < chunk.end;) {
+        const char *end = lineEnd(line, chunk.end);
+        const char *p = line;
+        std::string_view key = token(p, end);
+        bool ok = true;
+        if (key == "v") {
+            Vector3f v;
+            ok = parseVector(p, end, v);
+            chunk.positions.push_back(v);
+        }
+        else if (key == "f") {
+            corners.clear();
+            for (std::string_view corner = token(p, end); ok && !corner.empty() && corner[0] != '#';
+                 corner = token(p, end)) {
+                // only the position of v/vt/vn counts
+                int64_t index = 0;
+                const char *first = corner.data(), *last = first + corner.size();
+                auto result = std::from_chars(first, last, index);
+                ok = result.ec == std::errc() && index != 0 && index <= UINT32_MAX &&
+                     (result.ptr == last || *result.ptr == '/');
+                corners.push_back(index);
+            }
+            ok &= corners.size() >= 3;
+            for (size_t k = 1; ok && k + 1 < corners.size(); ++k) {
+                for (int64_t index : {corners[0], corners[k], corners[k + 1]}) {
+                    if (index < 0) {
+                        chunk.relative.push_back((uint32_t)chunk.indices.size());
+                        index += (int64_t)chunk.positions.size();
+                    }
+                    else
+                        --index;
+                    chunk.indices.push_back((uint32_t)index);
+                }
+            }
+        }
+        else if (key == "usemtl")
+            chunk.usemtl.emplace_back((uint32_t)(chunk.indices.size() / 3), rest(p, end));
+        else if (key == "mtllib")
+            chunk.mtllib.push_back(rest(p, end));
+        if (!ok && chunk.badLine.empty())
+            chunk.badLine = rest(line, end);
+        line = end + 1;
+    }
+}
+
+// Fills in the materials named in index from an .mtl file; a missing file
+// leaves them at their defaults.
+void loadMtl(const std::string &path, const std::unordered_map<std::string_view, uint32_t> &index,
+             std::vector<ObjMaterial> &materials) {
+    MappedFile file(path);
+    if (!file.ok) {
+        std::cerr << "cannot read " << path << "\n";
+        return;
+    }
+    ObjMaterial *material = nullptr;
+    const char *end = file.data + file.size;
+    for (const char *line = file.data; line < end;) {
+        const char *eol = lineEnd(line, end);
+        const char *p = line;
+        std::string_view key = token(p, eol);
+        if (key == "newmtl") {
+            auto found = index.find(rest(p, eol));
+            material = found != index.end() ? &materials[found->second] : nullptr;
+        }
+        else if (material) {
+            if (key == "Kd")
+                parseVector(p, eol, material->Kd);
+            else if (key == "Ks")
+                parseVector(p, eol, material->Ks);
+            else if (key == "Ke")
+                parseVector(p, eol, material->Ke);
+            else if (key == "Ns")
+                parseFloat(p, eol, material->Ns);
+            else if (key == "Ni")
+                parseFloat(p, eol, material->Ni);
+            else if (key == "d")
+                parseFloat(p, eol, material->d);
+            else if (key == "illum") {
+                std::string_view value = token(p, eol);
+                std::from_chars(value.data(), value.data() + value.size(), material->illum);
+            }
+        }
+        line = eol + 1;
+    }
+}
+}
+
+bool loadObj(const std::string &path, ObjMesh &mesh)
+{
+    MappedFile file(path);
+    if (!file.ok) {
+        std::cerr << "cannot read " << path << "\n";
+        return false;
+    }
+
+    // several chunks per thread, so that uneven ones even out
+    ThreadPool &pool = ThreadPool::get();
+    size_t chunkSize = std::max(kMinChunkSize, file.size / (4 * pool.size()) + 1);
+    std::vector<Chunk> chunks;
+    const char *end = file.data + file.size;
+    for (const char *p = file.data; p < end;) {
+        const char *next = (size_t)(end - p) > chunkSize ? lineEnd(p + chunkSize, end) : end;
+        if (next < end)
+            ++next;
+        chunks.emplace_back();
+        chunks.back().begin = p;
+        chunks.back().end = next;
+        p = next;
+    }
+    int n = (int)chunks.size();
+    if (n > 1)
+        pool.parallelFor(n, [&](int i) { parseChunk(chunks[i]); });
+    else if (n == 1)
+        parseChunk(chunks[0]);
+    for (const Chunk &chunk : chunks) {
+        if (!chunk.badLine.empty()) {
+            std::cerr << path << ": cannot read \"" << chunk.badLine << "\"\n";
+            return false;
+        }
+    }
+
+    // where each chunk goes in the merged buffers, and which material is
+    // current where it starts
+    std::vector<size_t> positionOffset(n + 1, 0), indexOffset(n + 1, 0);
+    std::vector<uint32_t> firstMaterial(n);
+    std::unordered_map<std::string_view, uint32_t> materialIndex;
+    std::vector<std::string_view> materialNames, mtllibs;
+    uint32_t current = ObjMesh::kNoMaterial;
+    for (int i = 0; i < n; ++i) {
+        positionOffset[i + 1] = positionOffset[i] + chunks[i].positions.size();
+        indexOffset[i + 1] = indexOffset[i] + chunks[i].indices.size();
+        firstMaterial[i] = current;
+        for (const auto &use : chunks[i].usemtl) {
+            auto inserted = materialIndex.emplace(use.second, (uint32_t)materialNames.size());
+            if (inserted.second)
+                materialNames.push_back(use.second);
+            current = inserted.first->second;
+        }
+        for (std::string_view lib : chunks[i].mtllib)
+            if (std::find(mtllibs.begin(), mtllibs.end(), lib) == mtllibs.end())
+                mtllibs.push_back(lib);
+    }
+    size_t numPositions = positionOffset[n];
+    if (numPositions > UINT32_MAX) {
+        std::cerr << path << ": too many vertices\n";
+        return false;
+    }
+
+    mesh.positions.resize(numPositions);
+    mesh.indices.resize(indexOffset[n]);
+    mesh.materialIds.resize(indexOffset[n] / 3);
+    std::vector<char> outOfRange(n, 0);
+    auto merge = [&](int i) {
+        const Chunk &chunk = chunks[i];
+        std::copy(chunk.positions.begin(), chunk.positions.end(), mesh.positions.begin() + positionOffset[i]);
+        uint32_t *indices = mesh.indices.data() + indexOffset[i];
+        std::copy(chunk.indices.begin(), chunk.indices.end(), indices);
+        for (uint32_t k : chunk.relative)
+            indices[k] += (uint32_t)positionOffset[i];
+        for (size_t k = 0; k < chunk.indices.size(); ++k)
+            outOfRange[i] |= indices[k] >= numPositions;
+
+        uint32_t *ids = mesh.materialIds.data() + indexOffset[i] / 3;
+        uint32_t id = firstMaterial[i], from = 0;
+        for (const auto &use : chunk.usemtl) {
+            std::fill(ids + from, ids + use.first, id);
+            from = use.first;
+            id = materialIndex.at(use.second);
+        }
+        std::fill(ids + from, ids + chunk.indices.size() / 3, id);
+    };
+    if (n > 1)
+        pool.parallelFor(n, merge);
+    else if (n == 1)
+        merge(0);
+    if (std::find(outOfRange.begin(), outOfRange.end(), 1) != outOfRange.end()) {
+        std::cerr << path << ": face refers to a vertex the file does not have\n";
+        return false;
+    }
+
+    mesh.materials.assign(materialNames.size(), ObjMaterial());
+    for (size_t k = 0; k < materialNames.size(); ++k)
+        mesh.materials[k].name = std::string(materialNames[k]);
+    std::string directory = path.substr(0, path.find_last_of("/\\") + 1);
+    mesh.materialLibraries.clear();
+    for (std::string_view lib : mtllibs) {
+        mesh.materialLibraries.push_back(directory + std::string(lib));
+        loadMtl(mesh.materialLibraries.back(), materialIndex, mesh.materials);
+    }
+    return true;
+}
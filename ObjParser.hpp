@@ -0,0 +1,44 @@
+#ifndef RAYTRACING_OBJPARSER_H
+#define RAYTRACING_OBJPARSER_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "Vector.hpp"
+
+// One newmtl entry of an .mtl file.
+struct ObjMaterial {
+    std::string name;
+    Vector3f Kd, Ks, Ke;
+    float Ns = 0;
+    float Ni = 1.5f;
+    float d = 1;
+    int illum = 0;
+};
+
+// Triangles of an OBJ file as an index buffer into its vertex positions.
+// Polygons are split into fans; texture coordinates and normals are
+// skipped.
+struct ObjMesh {
+    static constexpr uint32_t kNoMaterial = ~0u;
+
+    std::vector<Vector3f> positions;
+    // three per triangle, into positions
+    std::vector<uint32_t> indices;
+    // one per triangle, into materials, or kNoMaterial before the first
+    // usemtl
+    std::vector<uint32_t> materialIds;
+    // every material named by usemtl, in order of first use, with what the
+    // mtllib files say about it
+    std::vector<ObjMaterial> materials;
+    // paths of the .mtl files the materials were read from
+    std::vector<std::string> materialLibraries;
+};
+
+// Reads an OBJ file: the file is memory-mapped, cut into chunks at line
+// boundaries, and the chunks are parsed in parallel on the ThreadPool
+// without allocating per line or token. Returns false, with a message on
+// stderr, if the file cannot be read or refers to vertices it lacks.
+bool loadObj(const std::string &path, ObjMesh &mesh);
+
+#endif //RAYTRACING_OBJPARSER_H
@@ -7,21 +7,39 @@
 #include "Bounds3.hpp"
 #include "Ray.hpp"
 #include "Intersection.hpp"
+#include "Sampler.hpp"
+#include "RayPacket.hpp"
+#include "LightSampler.hpp"
 
 class Object
 {
 public:
     Object() {}
     virtual ~Object() {}
+    // occlusion test: does the ray hit the object within [t_min, t_max]
     virtual bool intersect(const Ray& ray) = 0;
     virtual bool intersect(const Ray& ray, float &, uint32_t &) const = 0;
-    virtual Intersection getIntersection(Ray _ray) = 0;
+    virtual Intersection getIntersection(const Ray& ray) = 0;
+    // closest hits for the rays of a packet selected by `rays`: isects[i] is
+    // replaced by any hit nearer than packet.tMax[i], which is then clipped
+    virtual void getIntersections(RayPacket &packet, uint32_t rays, Intersection *isects) {
+        for (int i = 0; i < packet.count; ++i) {
+            if (!(rays & (1u << i)))
+                continue;
+            Intersection inter = getIntersection(packet.rays[i]);
+            if (inter.happened && inter.distance <= packet.tMax[i]) {
+                isects[i] = inter;
+                packet.clip(i, inter.distance);
+            }
+        }
+    }
     virtual void getSurfaceProperties(const Vector3f &, const Vector3f &, const uint32_t &, const Vector2f &, Vector3f &, Vector2f &) const = 0;
     virtual Vector3f evalDiffuseColor(const Vector2f &) const =0;
     virtual Bounds3 getBounds()=0;
     virtual float getArea()=0;
-    virtual void Sample(Intersection &pos, float &pdf)=0;
     virtual bool hasEmit()=0;
+    // appends the emitting surfaces of the object, in world space
+    virtual void getEmitters(std::vector<Emitter> &) {}
 };
 
 
@@ -0,0 +1,41 @@
+#ifndef RAYTRACING_RAYPACKET_H
+#define RAYTRACING_RAYPACKET_H
+
+#include <cstdint>
+#include "Ray.hpp"
+
+// Up to kSize rays traced through the BVH together, e.g. the camera rays of
+// a 4x4 pixel block. Box tests run across the packet from the SoA copies
+// below, one ray per SIMD lane, so each node is fetched once for all rays;
+// leaves are still tested ray by ray. Rays are addressed by bit masks.
+struct RayPacket {
+    static constexpr int kSize = 16;
+
+    int count = 0;
+    Ray rays[kSize];
+    alignas(32) float origin[3][kSize];
+    alignas(32) float invDir[3][kSize];
+    alignas(32) float tMin[kSize];
+    alignas(32) float tMax[kSize];
+
+    void add(const Ray &ray) {
+        int i = count++;
+        rays[i] = ray;
+        for (int axis = 0; axis < 3; ++axis) {
+            origin[axis][i] = ray.origin[axis];
+            invDir[axis][i] = ray.direction_inv[axis];
+        }
+        tMin[i] = ray.t_min;
+        tMax[i] = ray.t_max;
+    }
+
+    uint32_t all() const { return (1u << count) - 1; }
+
+    // pulls ray i's interval in to a hit at distance t
+    void clip(int i, float t) {
+        rays[i].t_max = t;
+        tMax[i] = t;
+    }
+};
+
+#endif //RAYTRACING_RAYPACKET_H
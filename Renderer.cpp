@@ -1,29 +1,97 @@
+#include <algorithm>
+#include <atomic>
+#include <cstring>
 #include <fstream>
+#include <limits>
+#include <mutex>
 #include "Scene.hpp"
 #include "Renderer.hpp"
+#include "Image.hpp"
+#include "ThreadPool.hpp"
+#include "Wavefront.hpp"
 
 
 inline float deg2rad(const float& deg) { return deg * M_PI / 180.0; }
 
 const float EPSILON = 0.00001;
+
+// most paths one wavefront batch holds
+static constexpr int kWavefrontBatch = 8192;
 //const float EPSILON = 0.0001;
 
-Renderer::Renderer(std::vector<std::vector<double>>& v) : sobol_sequence(v), sobol_sequence_counter(0){
-    // for (auto x : v) {
-    //     std::cout << x[0] << "      " << x[1] << std::endl;
-    // }
+namespace {
+// Running statistics of the samples of one pixel. Welford's update keeps
+// the mean and the sum of squared deviations of the luminance numerically
+// stable; the color itself is only summed.
+struct PixelStats {
+    Vector3f sum;
+    int n = 0;
+    double mean = 0, m2 = 0;
+
+    void add(const Vector3f &L) {
+        sum += L;
+        double y = 0.2126 * L.x + 0.7152 * L.y + 0.0722 * L.z;
+        ++n;
+        double delta = y - mean;
+        mean += delta / n;
+        m2 += delta * (y - mean);
+    }
+
+    // standard error of the mean luminance relative to the mean itself;
+    // the floor keeps near-black pixels from demanding endless samples
+    double relativeError() const {
+        if (n < 2)
+            return std::numeric_limits<double>::infinity();
+        return std::sqrt(m2 / (n - 1) / n) / std::max(mean, 1e-2);
+    }
+};
+
+// A checkpoint holds the statistics of every pixel as they are in memory,
+// after a header naming the frame they belong to. It is only meant to be
+// read back by the same build on the same machine.
+struct CheckpointHeader {
+    char magic[8] = {'R', 'T', 'C', 'K', 'P', 'T', '1', 0};
+    int32_t width = 0, height = 0;
+    uint64_t seed = 0;
+};
+
+void writeCheckpoint(const std::string &path, int width, int height, uint64_t seed,
+                     const std::vector<PixelStats> &stats) {
+    CheckpointHeader header;
+    header.width = width;
+    header.height = height;
+    header.seed = seed;
+    OutputFile file(path);
+    file.put(header);
+    file.write(stats.data(), stats.size() * sizeof(PixelStats));
+    file.commit();
 }
 
-std::vector<double> Renderer::getSobolRandom() {
-    // each pair of sobol sequence are two numbers between 0 and 1
-    // we want the output to be a pair between -0.5 and 0.5
-    if (sobol_sequence_counter == sobol_sequence.size() - 1)
-        sobol_sequence_counter = 0;
-    std::vector<double> result = sobol_sequence[sobol_sequence_counter++];
-    result[0] -= 0.5;
-    result[1] -= 0.5;
-    return result;
-    // return sobol_sequence[sobol_sequence_counter++];
+// Loads stats from path if it holds a checkpoint of the same frame.
+bool readCheckpoint(const std::string &path, int width, int height, uint64_t seed,
+                    std::vector<PixelStats> &stats) {
+    FILE* fp = fopen(path.c_str(), "rb");
+    if (!fp) {
+        std::cerr << "no checkpoint at " << path << ", starting from scratch\n";
+        return false;
+    }
+    CheckpointHeader expected, header;
+    expected.width = width;
+    expected.height = height;
+    expected.seed = seed;
+    std::vector<PixelStats> loaded(stats.size());
+    bool ok = fread(&header, sizeof(header), 1, fp) == 1 &&
+              !memcmp(header.magic, expected.magic, sizeof(header.magic)) &&
+              header.width == width && header.height == height && header.seed == seed &&
+              fread(loaded.data(), sizeof(PixelStats), loaded.size(), fp) == loaded.size();
+    fclose(fp);
+    if (!ok) {
+        std::cerr << path << " does not match this frame, starting from scratch\n";
+        return false;
+    }
+    stats = std::move(loaded);
+    return true;
+}
 }
 
 // The main render function. This where we iterate over all pixels in the image,
@@ -31,102 +99,237 @@ std::vector<double> Renderer::getSobolRandom() {
 // framebuffer is saved to a file.
 void Renderer::Render(const Scene& scene)
 {
-    std::vector<Vector3f> framebuffer(scene.width * scene.height);
+    int numPixels = scene.width * scene.height;
+    std::vector<Vector3f> framebuffer(numPixels);
+    std::vector<PixelStats> stats(numPixels);
 
     float scale = tan(deg2rad(scene.fov * 0.5));
     float imageAspectRatio = scene.width / (float)scene.height;
     Vector3f eye_pos(278, 273, -800);
-    int m = 0;
 
     // for submission, render 4 images with 1, 4, 16, and 64 spp
     // change the spp value to change number of path samples per pixel
-    int spp = 128;
-    int spsp = spp / 4;
     // std::cout << "SPP: " << spp << "\n";
-    for (uint32_t j = 0; j < scene.height; ++j) {
-        for (uint32_t i = 0; i < scene.width; ++i) {
-            // generate primary ray direction
-            // float j_1 = j - 0.5; float j_2 = j + 0.5;
-            // float i_1 = i - 0.5; float i_2 = j + 0.5;
-            // if (j_1 < 0) j_1 = 0;
-            // if (j_2 > scene.height - 1) j_2 = scene.height - 1;
-            // if (i_1 < 0) i_1 = 0;
-            // if (i_2 > scene.width - 1) i_2 = scene.width - 1;
-            // for (int k = 0; k < spsp; ++k) {
-            //     auto temp = getSobolRandom();
-            //     float sy = j_1 + temp[0]; if (sy < 0) sy = 0;
-            //     float sx = i_1 + temp[1]; if (sx < 0) sx = 0;
-            //     float x = (2 * (sx + 0.5) / (float)scene.width - 1) *
-            //           imageAspectRatio * scale;
-            //     float y = (1 - 2 * (sy + 0.5) / (float)scene.height) * scale;
-            //     Vector3f dir = normalize(Vector3f(-x, y, 1));
-            //     framebuffer[m] += scene.castRay(Ray(eye_pos, dir)) / spp; 
-            // }
-            // for (int k = 0; k < spsp; ++k) {
-            //     auto temp = getSobolRandom();
-            //     float sy = j_1 + temp[0]; if (sy < 0) sy = 0;
-            //     float sx = i_2 + temp[1]; if (sx > scene.width - 1) sx = scene.width - 1;
-            //     float x = (2 * (sx + 0.5) / (float)scene.width - 1) *
-            //           imageAspectRatio * scale;
-            //     float y = (1 - 2 * (sy + 0.5) / (float)scene.height) * scale;
-            //     Vector3f dir = normalize(Vector3f(-x, y, 1));
-            //     framebuffer[m] += scene.castRay(Ray(eye_pos, dir)) / spp; 
-            // }
-            // for (int k = 0; k < spsp; ++k) {
-            //     auto temp = getSobolRandom();
-            //     float sy = j_2 + temp[0]; if (sy > scene.height - 1) sy = scene.height - 1;
-            //     float sx = i_1 + temp[1]; if (sx < 0) sx = 0;
-            //     float x = (2 * (sx + 0.5) / (float)scene.width - 1) *
-            //           imageAspectRatio * scale;
-            //     float y = (1 - 2 * (sy + 0.5) / (float)scene.height) * scale;
-            //     Vector3f dir = normalize(Vector3f(-x, y, 1));
-            //     framebuffer[m] += scene.castRay(Ray(eye_pos, dir)) / spp; 
-            // }
-            // for (int k = 0; k < spsp; ++k) {
-            //     auto temp = getSobolRandom();
-            //     float sy = j_2 + temp[0]; if (sy > scene.height - 1) sy = scene.height - 1;
-            //     float sx = i_2 + temp[1]; if (sx > scene.width - 1) sx = scene.width - 1;
-            //     float x = (2 * (sx + 0.5) / (float)scene.width - 1) *
-            //           imageAspectRatio * scale;
-            //     float y = (1 - 2 * (sy + 0.5) / (float)scene.height) * scale;
-            //     Vector3f dir = normalize(Vector3f(-x, y, 1));
-            //     framebuffer[m] += scene.castRay(Ray(eye_pos, dir)) / spp; 
-            // }
-            // float x = (2 * (i + 0.5) / (float)scene.width - 1) *
-            //           imageAspectRatio * scale;
-            // float y = (1 - 2 * (j + 0.5) / (float)scene.height) * scale;
-
-            // Vector3f dir = normalize(Vector3f(-x, y, 1));
-            for (int k = 0; k < spp; k++){
-                auto temp = getSobolRandom();
-                float sy = j + temp[0]; 
-                float sx = i + temp[1];
-                float x = (2 * (sx + 0.5) / (float)scene.width - 1) *
-                      imageAspectRatio * scale;
-                float y = (1 - 2 * (sy + 0.5) / (float)scene.height) * scale;
-                Vector3f dir = normalize(Vector3f(-x, y, 1));
-                framebuffer[m] += scene.castRay(Ray(eye_pos, dir), 0) / spp;  
+
+    // Every tile writes only to its own pixels and every pixel sums its
+    // samples in the same order, so the image does not depend on how many
+    // threads run or which of them picks up a tile.
+    int tilesX = (scene.width + tileSize - 1) / tileSize;
+    int tilesY = (scene.height + tileSize - 1) / tileSize;
+    int numTiles = tilesX * tilesY;
+    std::mutex progressMutex;
+
+    // Starts sample k of pixel (i, j) and returns its camera ray, jittered
+    // by the sample's first two dimensions.
+    auto cameraRay = [&](int i, int j, int k, Sampler &sampler) {
+        sampler.startPixelSample(j * scene.width + i, k);
+        Vector2f jitter = sampler.get2D();
+        float sx = i + jitter.x;
+        float sy = j + jitter.y;
+        float x = (2 * sx / (float)scene.width - 1) *
+              imageAspectRatio * scale;
+        float y = (1 - 2 * sy / (float)scene.height) * scale;
+        Vector3f dir = normalize(Vector3f(-x, y, 1));
+        return Ray(eye_pos, dir);
+    };
+
+    // Takes every pixel m of a tile from the samples it has to target[m]
+    // samples. Each pixel receives its samples in increasing order.
+    std::vector<int> target(numPixels);
+    auto renderTile = [&](int tile) {
+        Sampler sampler(seed);
+        int x0 = (tile % tilesX) * tileSize, x1 = std::min(x0 + tileSize, scene.width);
+        int y0 = (tile / tilesX) * tileSize, y1 = std::min(y0 + tileSize, scene.height);
+        if (wavefront) {
+            // Wavefront batches hold every pixel of the tile for as many
+            // samples as fit in kWavefrontBatch paths.
+            std::vector<Ray> rays;
+            std::vector<uint32_t> pixels, samples;
+            std::vector<Vector3f> radiance;
+            WavefrontTracer tracer(scene, seed);
+            auto flush = [&] {
+                tracer.trace(rays, pixels, samples, radiance);
+                for (size_t n = 0; n < rays.size(); ++n)
+                    stats[pixels[n]].add(radiance[n]);
+                rays.clear();
+                pixels.clear();
+                samples.clear();
+            };
+            for (int j = y0; j < y1; ++j) {
+                for (int i = x0; i < x1; ++i) {
+                    int m = j * scene.width + i;
+                    for (int k = stats[m].n; k < target[m]; ++k) {
+                        rays.push_back(cameraRay(i, j, k, sampler));
+                        pixels.push_back(m);
+                        samples.push_back(k);
+                        if ((int)rays.size() == kWavefrontBatch)
+                            flush();
+                    }
+                }
+            }
+            if (!rays.empty())
+                flush();
+        }
+        else if (packetTracing) {
+            // Camera rays of a 4x4 pixel block are nearly parallel, so they
+            // are traced as one packet; shading and every later bounce go
+            // ray by ray, since those rays no longer travel together.
+            for (int by = y0; by < y1; by += 4) {
+                for (int bx = x0; bx < x1; bx += 4) {
+                    int kBegin = std::numeric_limits<int>::max(), kEnd = 0;
+                    for (int j = by; j < std::min(by + 4, y1); ++j) {
+                        for (int i = bx; i < std::min(bx + 4, x1); ++i) {
+                            int m = j * scene.width + i;
+                            if (stats[m].n < target[m]) {
+                                kBegin = std::min(kBegin, stats[m].n);
+                                kEnd = std::max(kEnd, target[m]);
+                            }
+                        }
+                    }
+                    for (int k = kBegin; k < kEnd; k++) {
+                        RayPacket packet;
+                        int pixels[RayPacket::kSize];
+                        for (int j = by; j < std::min(by + 4, y1); ++j) {
+                            for (int i = bx; i < std::min(bx + 4, x1); ++i) {
+                                int m = j * scene.width + i;
+                                if (k < stats[m].n || k >= target[m])
+                                    continue;
+                                pixels[packet.count] = m;
+                                packet.add(cameraRay(i, j, k, sampler));
+                            }
+                        }
+                        Intersection hits[RayPacket::kSize];
+                        scene.intersect(packet, hits);
+                        for (int n = 0; n < packet.count; ++n) {
+                            sampler.startPixelSample(pixels[n], k, Sampler::kCameraDimensions);
+                            stats[pixels[n]].add(scene.castRay(packet.rays[n], hits[n], 0, sampler));
+                        }
+                    }
+                }
             }
-            m++;
         }
-        UpdateProgress(j / (float)scene.height);
+        else {
+            for (int j = y0; j < y1; ++j) {
+                for (int i = x0; i < x1; ++i) {
+                    int m = j * scene.width + i;
+                    for (int k = stats[m].n; k < target[m]; k++){
+                        Ray ray = cameraRay(i, j, k, sampler);
+                        stats[m].add(scene.castRay(ray, 0, sampler));
+                    }
+                }
+            }
+        }
+    };
+
+    // Without adaptive sampling one pass gives every pixel spp samples, or
+    // in progressive mode passes double every pixel's samples (1, 2, 4, ...)
+    // up to spp. With it, every pixel first gets minSpp samples; later
+    // passes add minSpp more to each pixel whose relative error is still
+    // above adaptiveThreshold, until all pixels converge, reach
+    // adaptiveMaxSpp, or the frame has used spp samples per pixel on
+    // average. Samples saved on smooth pixels thus go to noisy ones.
+    // Targets are derived from the samples the pixels already have, so a
+    // render resumed from a checkpoint carries on where the old one stopped.
+    int64_t budget = (int64_t)spp * numPixels, used = 0;
+    int maxSpp = adaptive ? (adaptiveMaxSpp > 0 ? adaptiveMaxSpp : 8 * spp) : spp;
+    // at most half the budget goes to the first pass, so that there is
+    // something left to redistribute
+    int minSpp = std::max(2, std::min(adaptiveMinSpp, spp / 2));
+    if (resume && readCheckpoint(checkpointFile, scene.width, scene.height, seed, stats))
+        std::cout << "Resuming from " << checkpointFile << "\n";
+    auto countSamples = [&] {
+        used = 0;
+        for (const PixelStats &pixel : stats)
+            used += pixel.n;
+    };
+    std::vector<int> pending;
+    // sets target for the next pass; false once the frame is done
+    auto planPass = [&] {
+        countSamples();
+        int warmup = adaptive ? minSpp : spp;
+        bool warm = true;
+        for (int m = 0; m < numPixels; ++m) {
+            int n = stats[m].n;
+            target[m] = n < warmup ? (progressive ? std::min(warmup, std::max(1, 2 * n)) : warmup) : n;
+            warm &= n >= warmup;
+        }
+        if (!warm)
+            return true;
+        if (!adaptive || used >= budget)
+            return false;
+
+        pending.clear();
+        for (int m = 0; m < numPixels; ++m)
+            if (stats[m].n < maxSpp && stats[m].relativeError() > adaptiveThreshold)
+                pending.push_back(m);
+        if (pending.empty())
+            return false;
+        // share out what is left of the budget evenly if it runs short, and
+        // if it does not cover one more sample each, give those to the
+        // noisiest pixels
+        int64_t remaining = budget - used;
+        if (remaining < (int64_t)pending.size()) {
+            std::nth_element(pending.begin(), pending.begin() + remaining, pending.end(),
+                             [&](int a, int b) { return stats[a].relativeError() > stats[b].relativeError(); });
+            pending.resize(remaining);
+        }
+        int64_t step = std::min<int64_t>(minSpp, remaining / (int64_t)pending.size());
+        for (int m : pending)
+            target[m] = (int)std::min<int64_t>(maxSpp, stats[m].n + step);
+        return true;
+    };
+    bool singlePass = !adaptive && !progressive;
+    while (planPass()) {
+        std::atomic<int> tilesDone(0);
+        ThreadPool::get().parallelFor(numTiles, [&](int tile) {
+            renderTile(tile);
+            int done = ++tilesDone;
+            std::lock_guard<std::mutex> lock(progressMutex);
+            if (singlePass)
+                UpdateProgress(done / (float)numTiles);
+        });
+        if (singlePass)
+            continue;
+        countSamples();
+        UpdateProgress(std::min(1.0, used / (double)budget));
+        if (progressive) {
+            for (int m = 0; m < numPixels; ++m)
+                framebuffer[m] = stats[m].sum / std::max(1, stats[m].n);
+            for (const std::string &output : outputFiles)
+                writeImage(output, scene.width, scene.height, framebuffer);
+            writeCheckpoint(checkpointFile, scene.width, scene.height, seed, stats);
+        }
     }
     UpdateProgress(1.f);
+    if (adaptive)
+        printf("\nAdaptive sampling: %.1f samples per pixel on average (budget %d)\n",
+               used / (double)numPixels, spp);
+    if (wavefront) {
+        std::cout << "\nWavefront stage times (summed over threads):\n";
+        for (int stage = 0; stage < WavefrontTracer::NumStages; ++stage)
+            printf("  %-8s %8.3f s\n", WavefrontTracer::stageName((WavefrontTracer::Stage)stage),
+                   WavefrontTracer::stageTime[stage] * 1e-9);
+    }
 
-    // save framebuffer to file
-    FILE* fp = fopen("binary.ppm", "wb");
-    (void)fprintf(fp, "P6\n%d %d\n255\n", scene.width, scene.height);
-    for (auto i = 0; i < scene.height * scene.width; ++i) {
-        static unsigned char color[3];
-        
-        // TODO: Implement correct gamma correction 
-        //       (by modifying the next three lines)
-        float coefficient = 1.0 / 2.2;
-        color[0] = (unsigned char) (255 * std::pow(clamp(0, 1, framebuffer[i].x), coefficient));
-        color[1] = (unsigned char) (255 * std::pow(clamp(0, 1, framebuffer[i].y), coefficient));
-        color[2] = (unsigned char) (255 * std::pow(clamp(0, 1, framebuffer[i].z), coefficient));
-
-        fwrite(color, 1, 3, fp);
+    int maxSamples = 1;
+    for (int m = 0; m < numPixels; ++m) {
+        framebuffer[m] = stats[m].sum / std::max(1, stats[m].n);
+        maxSamples = std::max(maxSamples, stats[m].n);
     }
-    fclose(fp);    
+
+    if (!heatmapFile.empty()) {
+        // samples per pixel, from blue (fewest) through green to red (most)
+        std::vector<uint8_t> heatmap(3 * numPixels);
+        for (int m = 0; m < numPixels; ++m) {
+            float t = stats[m].n / (float)maxSamples;
+            heatmap[3 * m + 0] = (uint8_t)(255 * clamp(0, 1, 2 * t - 1));
+            heatmap[3 * m + 1] = (uint8_t)(255 * (1 - std::fabs(2 * t - 1)));
+            heatmap[3 * m + 2] = (uint8_t)(255 * clamp(0, 1, 1 - 2 * t));
+        }
+        writeImage8(heatmapFile, scene.width, scene.height, heatmap);
+    }
+
+    // save framebuffer to file
+    for (const std::string &output : outputFiles)
+        writeImage(output, scene.width, scene.height, framebuffer);
 }
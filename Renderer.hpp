@@ -1,4 +1,3 @@
-
 #include "Scene.hpp"
 #include <vector>
 #include <chrono>
@@ -22,11 +21,40 @@ struct hit_payload
 class Renderer
 {
 public:
-    Renderer(std::vector<std::vector<double>>& v);
     void Render(const Scene& scene);
-    std::vector<double> getSobolRandom();
-    std::vector<std::vector<double>> sobol_sequence;
-    int sobol_sequence_counter;
+
+    // samples per pixel; with adaptive sampling, the average over the frame
+    int spp = 128;
+    // Adaptive sampling: pixels stop once the standard error of their mean
+    // luminance falls below adaptiveThreshold times the mean, and the
+    // samples they save go to the noisier ones. adaptiveMaxSpp = 0 allows
+    // up to 8 * spp samples in one pixel.
+    bool adaptive = false;
+    float adaptiveThreshold = 0.02f;
+    int adaptiveMinSpp = 16;
+    int adaptiveMaxSpp = 0;
+    // when set, a false-color image of the samples each pixel took is
+    // written there, as .ppm or .png
+    std::string heatmapFile;
+    // the frame is cut into tileSize x tileSize tiles that the thread pool
+    // hands out to its workers
+    int tileSize = 16;
+    // seed of the per-pixel sample streams; equal seeds give equal images
+    uint64_t seed = 0;
+    // trace camera rays in packets of 4x4 pixels instead of one at a time
+    bool packetTracing = true;
+    // trace paths with the WavefrontTracer instead of Scene::castRay
+    bool wavefront = false;
+    // Progressive rendering: complete passes over the whole frame (1, 2, 4,
+    // ... spp, or the adaptive passes), each followed by writing the image
+    // so far to outputFiles and the accumulated samples to checkpointFile.
+    // With resume, a render picks up from checkpointFile.
+    bool progressive = false;
+    bool resume = false;
+    // the image is written to each of these, in the format its extension
+    // names (see writeImage)
+    std::vector<std::string> outputFiles = {"binary.ppm"};
+    std::string checkpointFile = "binary.ckpt";
 
 private:
 };
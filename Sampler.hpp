@@ -0,0 +1,111 @@
+#ifndef RAYTRACING_SAMPLER_H
+#define RAYTRACING_SAMPLER_H
+
+#include <cstdint>
+#include "Vector.hpp"
+
+inline uint64_t mixBits(uint64_t v) {
+    v ^= (v >> 31);
+    v *= 0x7fb5d329728ea185ULL;
+    v ^= (v >> 27);
+    v *= 0x81dadef4bc2dd44dULL;
+    v ^= (v >> 33);
+    return v;
+}
+
+inline uint32_t reverseBits32(uint32_t v) {
+    v = (v << 16) | (v >> 16);
+    v = ((v & 0x00ff00ff) << 8) | ((v & 0xff00ff00) >> 8);
+    v = ((v & 0x0f0f0f0f) << 4) | ((v & 0xf0f0f0f0) >> 4);
+    v = ((v & 0x33333333) << 2) | ((v & 0xcccccccc) >> 2);
+    v = ((v & 0x55555555) << 1) | ((v & 0xaaaaaaaa) >> 1);
+    return v;
+}
+
+// The first two dimensions of the Sobol sequence, as 32-bit fixed point
+// fractions. The first is the van der Corput sequence; the second has the
+// direction numbers v_0 = 1/2, v_i = v_{i-1} ^ (v_{i-1} >> 1).
+inline uint32_t sobol0(uint32_t index) { return reverseBits32(index); }
+
+inline uint32_t sobol1(uint32_t index) {
+    uint32_t x = 0;
+    for (uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1)
+        if (index & 1)
+            x ^= v;
+    return x;
+}
+
+// Owen scrambling with the hash of Laine and Karras as refined by Burley
+// ("Practical Hash-based Owen Scrambling", JCGT 2020): every bit is flipped
+// depending on the seed and on the bits above it only, which keeps the
+// stratification of the sequence intact.
+inline uint32_t owenScramble(uint32_t v, uint32_t seed) {
+    v = reverseBits32(v);
+    v ^= v * 0x3d20adea;
+    v += seed;
+    v *= (seed >> 16) | 1;
+    v ^= v * 0x05526c56;
+    v ^= v * 0x53a22864;
+    return reverseBits32(v);
+}
+
+// Source of every random number used while tracing a path.
+//
+// Samples come from a padded, Owen-scrambled Sobol sequence: each value a
+// path draws is a dimension, and every 1D or 2D draw takes its value from
+// the first one or two Sobol dimensions at the sample's index, scrambled
+// with a seed hashed from the render seed, the pixel and the dimension.
+// The index itself is shuffled with the same kind of scramble, so that
+// different dimensions of one sample are not correlated. The samples of a
+// pixel are thus stratified in every 1D and 2D projection, and any prefix
+// of 2^m samples is as well, so progressive and adaptive passes keep the
+// stratification.
+//
+// A value depends only on (seed, pixel, sample, dimension) and is computed
+// directly, without tables: a sample draws the same numbers no matter which
+// thread traces it or what was traced before, which keeps renders
+// reproducible.
+class Sampler {
+public:
+    // the camera ray of every sample takes the first two dimensions
+    static constexpr uint32_t kCameraDimensions = 2;
+
+    explicit Sampler(uint64_t seed = 0) : seed(seed) {}
+
+    void startPixelSample(uint32_t pixelIndex, uint32_t sampleIndex, uint32_t dimension = 0) {
+        pixelHash = mixBits(((uint64_t)pixelIndex << 32) ^ mixBits(seed));
+        this->sampleIndex = sampleIndex;
+        this->dimension = dimension;
+    }
+
+    float get1D() {
+        uint64_t hash = dimensionHash(1);
+        uint32_t index = owenScramble(sampleIndex, (uint32_t)hash);
+        return toFloat(owenScramble(sobol0(index), (uint32_t)(hash >> 32)));
+    }
+
+    Vector2f get2D() {
+        uint64_t hash = dimensionHash(2);
+        uint32_t index = owenScramble(sampleIndex, (uint32_t)hash);
+        uint32_t seed1 = (uint32_t)mixBits(hash);
+        return Vector2f(toFloat(owenScramble(sobol0(index), (uint32_t)(hash >> 32))),
+                        toFloat(owenScramble(sobol1(index), seed1)));
+    }
+
+private:
+    // seeds of a draw that takes the next count dimensions
+    uint64_t dimensionHash(uint32_t count) {
+        uint64_t hash = mixBits(pixelHash ^ (0x9e3779b97f4a7c15ULL * (dimension + 1)));
+        dimension += count;
+        return hash;
+    }
+
+    // uniform float in [0, 1)
+    static float toFloat(uint32_t v) { return (v >> 8) * 0x1p-24f; }
+
+    uint64_t seed;
+    uint64_t pixelHash = 0;
+    uint32_t sampleIndex = 0, dimension = 0;
+};
+
+#endif //RAYTRACING_SAMPLER_H
@@ -1,32 +1,50 @@
 #include "Scene.hpp"
 
+// Origin for a ray that leaves p, on the surface with normal N, in direction
+// w: moved off the surface to the side w points to, far enough to clear the
+// rounding of p's coordinates, so that the ray cannot hit the surface it
+// starts on. Triangles are hit from both sides, so every ray needs it.
+static Vector3f offsetOrigin(const Vector3f &p, const Vector3f &N, const Vector3f &w)
+{
+    float scale = std::max({1.0f, std::fabs(p.x), std::fabs(p.y), std::fabs(p.z)});
+    Vector3f offset = N * (EPSILON * scale);
+    return dotProduct(w, N) < 0 ? p - offset : p + offset;
+}
+
 void Scene::buildBVH() {
     printf(" - Generating BVH...\n\n");
-    this->bvh = new BVHAccel(objects, 1, BVHAccel::SplitMethod::NAIVE);
+    this->bvh = new BVHAccel(objects, 4, BVHAccel::SplitMethod::SAH);
+    std::vector<Emitter> emitters;
+    for (Object *object : objects)
+        object->getEmitters(emitters);
+    lightSampler.build(std::move(emitters));
 }
 
 Intersection Scene::intersect(const Ray &ray) const {
     return this->bvh->Intersect(ray);
 }
 
-void Scene::sampleLight(Intersection &pos, float &pdf) const {
-    float emit_area_sum = 0;
-    for (uint32_t k = 0; k < objects.size(); ++k) {
-        if (objects[k]->hasEmit()) {
-            emit_area_sum += objects[k]->getArea();
-        }
-    }
-    float p = get_random_float() * emit_area_sum;
-    emit_area_sum = 0;
-    for (uint32_t k = 0; k < objects.size(); ++k) {
-        if (objects[k]->hasEmit()) {
-            emit_area_sum += objects[k]->getArea();
-            if (p <= emit_area_sum) {
-                objects[k]->Sample(pos, pdf);
-                break;
-            }
-        }
-    }
+void Scene::intersect(RayPacket &packet, Intersection *isects) const {
+    this->bvh->Intersect(packet, packet.all(), isects);
+}
+
+bool Scene::visible(const Vector3f &p, const Vector3f &q) const {
+    Vector3f d = q - p;
+    float dist = d.norm();
+    Ray ray(p, d / dist);
+    // stop just short of q so the surface q lies on does not count
+    ray.t_max = dist * (1.0f - 1e-4f);
+    return !this->bvh->IntersectP(ray);
+}
+
+void Scene::sampleLight(Intersection &pos, float &pdf, Sampler &sampler) const {
+    lightSampler.sample(pos, pdf, sampler);
+}
+
+float Scene::lightPdf(const Vector3f &p, const Vector3f &q, const Vector3f &Nq, const Vector3f &emit) const {
+    Vector3f w = p - q;
+    float cosThetaLight = std::fabs(dotProduct(normalize(w), Nq));
+    return cosThetaLight > 0 ? dotProduct(w, w) * lightSampler.pdf(emit) / cosThetaLight : 0.0f;
 }
 
 bool Scene::trace(
@@ -48,109 +66,79 @@ bool Scene::trace(
     return (*hitObject != nullptr);
 }
 
-Vector3f Scene::castRay(const Ray &ray, int depth) const {
-    auto inter = intersect(ray);
-    if (!inter.happened) {
-        return Vector3f();
-    }
-    Material *m = inter.m;
-    auto p = inter.coords;
-    auto N = inter.normal;
-    // auto wo = ray.direction_inv;
-    auto wo = -ray.direction;
-
-    if (inter.obj -> hasEmit()) return inter.emit;
-
-    if (m->getType() == DIFFUSE) {
-        Vector3f L_dir;
-        Vector3f L_indir;
-        Intersection light_inter;
-        float light_pdf = 0.0;
-
-        sampleLight(light_inter, light_pdf);
-        auto L_i = light_inter.emit;
-        auto x_prime = light_inter.coords;
-        auto N_prime = light_inter.normal;
-        auto w = -(x_prime - p);           
-        auto w_normalized = w.normalized();
-
-        float light_area = 1.0 / light_pdf;
-        float cos_theta = dotProduct(N.normalized(), -w.normalized());
-        float cos_theta_prime = dotProduct(w_normalized, N_prime.normalized());
+Scene::ShadowRay Scene::sampleDirect(const Vector3f &p, const Vector3f &N, Material *m,
+                                     const Vector3f &wo, Sampler &sampler) const {
+    Intersection light;
+    float lightPdf = 0.0f;
+    sampleLight(light, lightPdf, sampler);
+    Vector3f w = p - light.coords;
+    Vector3f wn = normalize(w);
+    float cosTheta = dotProduct(N, -wn);
+    float cosThetaLight = dotProduct(wn, light.normal);
+    // lights below the surface count too, for materials that transmit;
+    // eval is zero there for the others
+    if (cosTheta == 0.0f || cosThetaLight <= 0.0f)
+        return {p, light.coords, Vector3f(0.0f)};
+    Vector3f from = offsetOrigin(p, N, -wn);
+    // area pdf of the light sample turned into a solid angle pdf at p
+    float pdfLightW = dotProduct(w, w) * lightPdf / cosThetaLight;
+    float weight = powerHeuristic(pdfLightW, m->pdf(wo, -wn, N));
+    return {from, light.coords, light.emit * m->eval(wo, -wn, N) * (std::fabs(cosTheta) / pdfLightW * weight)};
+}
 
-        float pdf_light_w = w.norm() * w.norm() / (light_area * cos_theta_prime);
+bool Scene::sampleBounce(const Vector3f &p, const Vector3f &N, Material *m, int depth, Sampler &sampler,
+                         Ray &ray, Vector3f &throughput, bool &specular, float &pdf) const {
+    // Russian roulette after five bounces
+    float pRR = sampler.get1D();
+    BSDFSample bs;
+    if (!m->sample(-ray.direction, N, sampler, bs))
+        return false;
+    float weight = 1.0f;
+    if (depth >= 5) {
+        if (pRR >= RussianRoulette)
+            return false;
+        weight = 1.0f / RussianRoulette;
+    }
+    throughput = throughput * bs.weight * weight;
+    ray = Ray(offsetOrigin(p, N, bs.wi), bs.wi);
+    specular = bs.specular;
+    pdf = bs.pdf;
+    return true;
+}
 
-        // shoot a ray from p to x_prime
-        // if the ray is not block in the middle
-        auto obj_to_light_ray = Ray(p, -w);
-        auto light_blocked = intersect(obj_to_light_ray);
-        if (light_blocked.happened && light_blocked.obj -> hasEmit()) {
-            L_dir = L_i * inter.m -> eval(wo, -w, N) * cos_theta / pdf_light_w;
-        }
+Vector3f Scene::castRay(const Ray &ray, int depth, Sampler &sampler) const {
+    return castRay(ray, intersect(ray), depth, sampler);
+}
 
-        // contribution fron other reflectors
-        float p_RR = get_random_float();
-        if (depth >= 5) {
-            if (p_RR < RussianRoulette) {
-                // randomly sample the hemisphere toward w_i(pdf_brdf)
-                // Trace a ray r(p, w_i)
-                Vector3f obj_to_obj_normalized = inter.m -> sample(wo, N).normalized();
-                float pdf_brdf = inter.m -> pdf(wo, obj_to_obj_normalized, N);
-                Ray obj_to_obj_ray = Ray(p, obj_to_obj_normalized);
-                auto obj_inter = intersect(obj_to_obj_ray);
-                if (obj_inter.happened && !(obj_inter.m -> hasEmission())) {
-                    L_indir = castRay(obj_to_obj_ray, depth++) * inter.m -> eval(wo, obj_to_obj_normalized, N) *
-                                dotProduct(N.normalized(), obj_to_obj_normalized) / pdf_brdf / RussianRoulette;
-                }   
-            }
-        } else {
-                Vector3f obj_to_obj_normalized = inter.m -> sample(wo, N).normalized();
-                float pdf_brdf = inter.m -> pdf(wo, obj_to_obj_normalized, N);
-                Ray obj_to_obj_ray = Ray(p, obj_to_obj_normalized);
-                auto obj_inter = intersect(obj_to_obj_ray);
-                if (obj_inter.happened && !(obj_inter.m -> hasEmission())) {
-                    L_indir = castRay(obj_to_obj_ray, depth++) * inter.m -> eval(wo, obj_to_obj_normalized, N) *
-                                dotProduct(N.normalized(), obj_to_obj_normalized) / pdf_brdf;
-                }   
+// Iterative path tracer. Each pass of the loop handles one hit and leaves
+// the ray to follow next; `throughput` is the product of BSDF * cos / pdf
+// of the bounces so far, so the light found at any hit is weighted by it.
+// Every ray is intersected exactly once.
+Vector3f Scene::castRay(const Ray &cameraRay, const Intersection &firstHit, int depth, Sampler &sampler) const {
+    Vector3f radiance(0.0f), throughput(1.0f);
+    Ray ray = cameraRay;
+    Intersection inter = firstHit;
+    // light hit directly by the camera or through a mirror is counted in
+    // full; after any other bounce it shares with that bounce's shadow ray
+    bool specular = true;
+    float bsdfPdf = 0.0f;
+    while (inter.happened) {
+        if (inter.m->hasEmission()) {
+            radiance += throughput * inter.emit *
+                        emitterWeight(ray.origin, bsdfPdf, specular, inter.coords, inter.normal, inter.emit);
+            break;
         }
-        auto result = L_dir + L_indir;
-        
-        return result;
-    } else if (m->getType() == SPECULAR) {
-        // perfect SPECULAR
-        // incidence angle = refleciton angle
-        float kr;
-        fresnel(ray.direction, N, m->ior, kr);
-        Vector3f spectrum = Vector3f(0.0f);
-        Vector3f refl_dir = reflect(ray.direction, N);
-        Vector3f refl_ori;
-        if (dotProduct(refl_dir, N) < 0) {
-            refl_ori = p + N * EPSILON; 
-        } else {
-            refl_ori = p - N * EPSILON;
+        Material *m = inter.m;
+        Vector3f p = inter.coords, N = inter.normal;
+        if (!m->isSpecular()) {
+            ShadowRay shadow = sampleDirect(p, N, m, -ray.direction, sampler);
+            if (visible(shadow.from, shadow.to))
+                radiance += throughput * shadow.contribution;
         }
-        auto result = castRay(Ray(refl_ori, refl_dir),depth++) * kr;
-        return result;
-    } else {
-        // GLASS
-        // need to consider both reflection and refraction
-        float eta = (wo.z > 0) ? (1.f / m->ior) : m->ior;
-        float predicate = 1 - eta * eta * (1 - wo.z * wo.z);
-        Vector3f refl_dir = normalize(reflect(ray.direction, N));
-        Vector3f refra_dir = normalize(refract(ray.direction, N, m->ior));
-        Vector3f spectrum = Vector3f(0.0f);
-        Vector3f refl_ori;
-        Vector3f refra_ori;
-        if (dotProduct(refl_dir, N) < 0) refl_ori = p - N * EPSILON;
-        else refl_ori = p + N * EPSILON;
-        if (dotProduct(refra_dir, N) < 0) refra_ori = p - N * EPSILON;
-        else refra_ori = p + N * EPSILON;
-        Vector3f refl_part = castRay(Ray(refl_ori, refl_dir), depth++);
-        Vector3f refra_part = castRay(Ray(refra_ori, refra_dir), depth++);
-        float kr;
-        fresnel(ray.direction, N, m->ior, kr);
-        Vector3f result = refl_part * kr + refra_part * (1 - kr);
-        return result;
+        if (!sampleBounce(p, N, m, depth, sampler, ray, throughput, specular, bsdfPdf))
+            break;
+        ++depth;
+        inter = intersect(ray);
     }
-    return Vector3f(0.0);
-}
\ No newline at end of file
+    return radiance;
+}
@@ -30,10 +30,47 @@ public:
     const std::vector<Object*>& get_objects() const { return objects; }
     const std::vector<std::unique_ptr<Light> >&  get_lights() const { return lights; }
     Intersection intersect(const Ray& ray) const;
+    // closest hits of all rays of a packet, one Intersection per ray
+    void intersect(RayPacket &packet, Intersection *isects) const;
+    // shadow-ray test: true when nothing blocks the segment from p to q
+    bool visible(const Vector3f &p, const Vector3f &q) const;
     BVHAccel *bvh;
+    // every emitting surface, gathered by buildBVH
+    LightSampler lightSampler;
     void buildBVH();
-    Vector3f castRay(const Ray &ray, int depth) const;
-    void sampleLight(Intersection &pos, float &pdf) const;
+    Vector3f castRay(const Ray &ray, int depth, Sampler &sampler) const;
+    // castRay for a ray whose closest hit is already known
+    Vector3f castRay(const Ray &ray, const Intersection &inter, int depth, Sampler &sampler) const;
+
+    // Path tracing steps shared by castRay and the WavefrontTracer.
+    // Light reaching a non-specular hit p from one sample on the emitters: it
+    // counts if nothing blocks the segment from `from` to `to`.
+    struct ShadowRay {
+        Vector3f from, to, contribution;
+    };
+    // The contribution is weighted against BSDF sampling with the power
+    // heuristic, so light that a non-specular bounce hits adds the rest (see
+    // emitterWeight).
+    ShadowRay sampleDirect(const Vector3f &p, const Vector3f &N, Material *m, const Vector3f &wo,
+                           Sampler &sampler) const;
+    // Solid angle pdf with which sampleDirect at p picks the point q, with
+    // normal Nq and emission emit, on an emitter.
+    float lightPdf(const Vector3f &p, const Vector3f &q, const Vector3f &Nq, const Vector3f &emit) const;
+    // MIS weight of emission emit at q, on an emitter with normal Nq, that a
+    // bounce from p with direction pdf bsdfPdf hit; specular bounces have
+    // no light sample to share with and keep all of it.
+    float emitterWeight(const Vector3f &p, float bsdfPdf, bool specular,
+                        const Vector3f &q, const Vector3f &Nq, const Vector3f &emit) const {
+        return specular ? 1.0f : powerHeuristic(bsdfPdf, lightPdf(p, q, Nq, emit));
+    }
+    // Replaces `ray`, which hit p, by the ray the path continues with and
+    // scales throughput by the bounce's weight. `specular` tells whether the
+    // bounce was a perfect reflection or refraction, and pdf is the solid
+    // angle pdf of the new direction otherwise. Returns false when the path
+    // ends instead.
+    bool sampleBounce(const Vector3f &p, const Vector3f &N, Material *m, int depth, Sampler &sampler,
+                      Ray &ray, Vector3f &throughput, bool &specular, float &pdf) const;
+    void sampleLight(Intersection &pos, float &pdf, Sampler &sampler) const;
     bool trace(const Ray &ray, const std::vector<Object*> &objects, float &tNear, uint32_t &index, Object **hitObject);
     std::tuple<Vector3f, Vector3f> HandleAreaLight(const AreaLight &light, const Vector3f &hitPoint, const Vector3f &N,
                                                    const Vector3f &shadowPointOrig,
@@ -43,65 +80,4 @@ public:
     // creating the scene (adding objects and lights)
     std::vector<Object* > objects;
     std::vector<std::unique_ptr<Light> > lights;
-
-    // Compute reflection direction
-    Vector3f reflect(const Vector3f &I, const Vector3f &N) const
-    {
-        return I - 2 * dotProduct(I, N) * N;
-    }
-
-    // Compute refraction direction using Snell's law
-    //
-    // We need to handle with care the two possible situations:
-    //
-    //    - When the ray is inside the object
-    //
-    //    - When the ray is outside.
-    //
-    // If the ray is outside, you need to make cosi positive cosi = -N.I
-    //
-    // If the ray is inside, you need to invert the refractive indices and negate the normal N
-    Vector3f refract(const Vector3f &I, const Vector3f &N, const float &ior) const
-    {
-        float cosi = clamp(-1, 1, dotProduct(I, N));
-        float etai = 1, etat = ior;
-        Vector3f n = N;
-        if (cosi < 0) { cosi = -cosi; } else { std::swap(etai, etat); n= -N; }
-        float eta = etai / etat;
-        float k = 1 - eta * eta * (1 - cosi * cosi);
-        return k < 0 ? 0 : eta * I + (eta * cosi - sqrtf(k)) * n;
-    }
-
-
-
-    // Compute Fresnel equation
-    //
-    // \param I is the incident view direction
-    //
-    // \param N is the normal at the intersection point
-    //
-    // \param ior is the material refractive index
-    //
-    // \param[out] kr is the amount of light reflected
-    void fresnel(const Vector3f &I, const Vector3f &N, const float &ior, float &kr) const
-    {
-        float cosi = clamp(-1, 1, dotProduct(I, N));
-        float etai = 1, etat = ior;
-        if (cosi > 0) {  std::swap(etai, etat); }
-        // Compute sini using Snell's law
-        float sint = etai / etat * sqrtf(std::max(0.f, 1 - cosi * cosi));
-        // Total internal reflection
-        if (sint >= 1) {
-            kr = 1;
-        }
-        else {
-            float cost = sqrtf(std::max(0.f, 1 - sint * sint));
-            cosi = fabsf(cosi);
-            float Rs = ((etat * cosi) - (etai * cost)) / ((etat * cosi) + (etai * cost));
-            float Rp = ((etai * cosi) - (etat * cost)) / ((etai * cosi) + (etat * cost));
-            kr = (Rs * Rs + Rp * Rp) / 2;
-        }
-        // As a consequence of the conservation of energy, transmittance is given by:
-        // kt = 1 - kr;
-    }
 };
\ No newline at end of file
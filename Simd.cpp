@@ -0,0 +1,41 @@
+#include "Simd.hpp"
+#include <initializer_list>
+
+bool cpuSupports(SimdLevel level)
+{
+    switch (level) {
+        case SimdLevel::Scalar: return true;
+#ifdef RAYTRACING_X86_SIMD
+        case SimdLevel::SSE: return true;
+        case SimdLevel::AVX2: return __builtin_cpu_supports("avx2");
+#endif
+        default: return false;
+    }
+}
+
+static SimdLevel bestSimdLevel()
+{
+    for (SimdLevel level : {SimdLevel::AVX2, SimdLevel::SSE})
+        if (cpuSupports(level))
+            return level;
+    return SimdLevel::Scalar;
+}
+
+SimdLevel simdLevel = bestSimdLevel();
+
+bool setSimdLevel(SimdLevel level)
+{
+    if (!cpuSupports(level))
+        return false;
+    simdLevel = level;
+    return true;
+}
+
+const char *simdLevelName(SimdLevel level)
+{
+    switch (level) {
+        case SimdLevel::SSE: return "sse";
+        case SimdLevel::AVX2: return "avx2";
+        default: return "scalar";
+    }
+}
@@ -0,0 +1,29 @@
+#ifndef RAYTRACING_SIMD_H
+#define RAYTRACING_SIMD_H
+
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__SSE2__)
+#define RAYTRACING_X86_SIMD 1
+#include <immintrin.h>
+// AVX2 kernels are compiled per function, so the rest of the program still
+// runs on CPUs without it
+#define RAYTRACING_AVX2 __attribute__((target("avx2")))
+#endif
+
+// Instruction sets the SIMD kernels come in. The widest one the CPU supports
+// is picked at startup and setSimdLevel overrides it; kernels dispatch on
+// simdLevel at every call.
+enum class SimdLevel { Scalar, SSE, AVX2 };
+
+extern SimdLevel simdLevel;
+
+bool cpuSupports(SimdLevel level);
+// Returns false and keeps the current level if the CPU lacks this one.
+bool setSimdLevel(SimdLevel level);
+const char *simdLevelName(SimdLevel level);
+
+// floats per vector at the current level
+inline int simdWidth() {
+    return simdLevel == SimdLevel::AVX2 ? 8 : simdLevel == SimdLevel::SSE ? 4 : 1;
+}
+
+#endif //RAYTRACING_SIMD_H
@@ -21,10 +21,9 @@ public:
         float b = 2 * dotProduct(ray.direction, L);
         float c = dotProduct(L, L) - radius2;
         float t0, t1;
-        float area = 4 * M_PI * radius2;
         if (!solveQuadratic(a, b, c, t0, t1)) return false;
-        if (t0 < 0) t0 = t1;
-        if (t0 < 0) return false;
+        if (t0 < ray.t_min) t0 = t1;
+        if (t0 < ray.t_min || t0 > ray.t_max) return false;
         return true;
     }
     bool intersect(const Ray& ray, float &tnear, uint32_t &index) const
@@ -43,7 +42,7 @@ public:
 
         return true;
     }
-    Intersection getIntersection(Ray ray){
+    Intersection getIntersection(const Ray &ray){
         Intersection result;
         result.happened = false;
         Vector3f L = ray.origin - center;
@@ -52,13 +51,14 @@ public:
         float c = dotProduct(L, L) - radius2;
         float t0, t1;
         if (!solveQuadratic(a, b, c, t0, t1)) return result;
-        if (t0 < 0) t0 = t1;
-        if (t0 < 0) return result;
+        if (t0 < ray.t_min) t0 = t1;
+        if (t0 < ray.t_min || t0 > ray.t_max) return result;
         result.happened=true;
 
         result.coords = Vector3f(ray.origin + ray.direction * t0);
         result.normal = normalize(Vector3f(result.coords - center));
         result.m = this->m;
+        result.emit = m->getEmission();
         result.obj = this;
         result.distance = t0;
         return result;
@@ -74,20 +74,16 @@ public:
         return Bounds3(Vector3f(center.x-radius, center.y-radius, center.z-radius),
                        Vector3f(center.x+radius, center.y+radius, center.z+radius));
     }
-    void Sample(Intersection &pos, float &pdf){
-        float theta = 2.0 * M_PI * get_random_float(), phi = M_PI * get_random_float();
-        Vector3f dir(std::cos(phi), std::sin(phi)*std::cos(theta), std::sin(phi)*std::sin(theta));
-        pos.coords = center + radius * dir;
-        pos.normal = dir;
-        pos.emit = m->getEmission();
-        pdf = 1.0f / area;
-    }
     float getArea(){
         return area;
     }
     bool hasEmit(){
         return m->hasEmission();
     }
+    void getEmitters(std::vector<Emitter> &emitters){
+        if (hasEmit())
+            emitters.push_back(Emitter::sphere(center, radius, m->getEmission()));
+    }
 };
 
 
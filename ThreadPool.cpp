@@ -0,0 +1,137 @@
+#include "ThreadPool.hpp"
+
+// Queue owned by the current thread; threads outside the pool share queue 0.
+static thread_local const ThreadPool *currentPool = nullptr;
+static thread_local int currentQueue = 0;
+
+static std::unique_ptr<ThreadPool> globalPool;
+
+ThreadPool::ThreadPool(int numThreads)
+{
+    if (numThreads <= 0)
+        numThreads = std::max(1u, std::thread::hardware_concurrency());
+    for (int i = 0; i < numThreads; ++i)
+        queues.push_back(std::make_unique<WorkQueue>());
+    // queue 0 belongs to whichever thread calls parallelFor
+    for (int i = 1; i < numThreads; ++i)
+        workers.emplace_back(&ThreadPool::workerLoop, this, i);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        shutdown = true;
+    }
+    wakeup.notify_all();
+    for (auto &worker : workers)
+        worker.join();
+}
+
+void ThreadPool::push(int queue, std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> lock(queues[queue]->mutex);
+        queues[queue]->tasks.push_back(std::move(task));
+    }
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        ++pendingTasks;
+    }
+    wakeup.notify_one();
+}
+
+void ThreadPool::submit(std::function<void()> task)
+{
+    int queue = currentPool == this ? currentQueue
+                                    : (int)(nextQueue++ % queues.size());
+    push(queue, std::move(task));
+}
+
+bool ThreadPool::popTask(std::function<void()> &task)
+{
+    int self = currentPool == this ? currentQueue : 0;
+    {
+        WorkQueue &own = *queues[self];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty()) {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            --pendingTasks;
+            return true;
+        }
+    }
+    for (size_t k = 1; k < queues.size(); ++k) {
+        WorkQueue &victim = *queues[(self + k) % queues.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            --pendingTasks;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ThreadPool::runPendingTask()
+{
+    std::function<void()> task;
+    if (!popTask(task))
+        return false;
+    task();
+    return true;
+}
+
+void ThreadPool::workerLoop(int index)
+{
+    currentPool = this;
+    currentQueue = index;
+    for (;;) {
+        if (runPendingTask())
+            continue;
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        wakeup.wait(lock, [this] { return shutdown || pendingTasks > 0; });
+        if (shutdown)
+            return;
+    }
+}
+
+void ThreadPool::parallelFor(int count, const std::function<void(int)> &func)
+{
+    if (count <= 0)
+        return;
+    if (queues.size() == 1) {
+        for (int i = 0; i < count; ++i)
+            func(i);
+        return;
+    }
+
+    // Deal out contiguous runs of indices so neighbouring work starts on the
+    // same thread; stealing evens out whatever imbalance is left.
+    std::atomic<int> remaining(count);
+    int numQueues = (int)queues.size();
+    for (int i = 0; i < count; ++i) {
+        int queue = (int)((long long)i * numQueues / count);
+        push(queue, [&func, &remaining, i] {
+            func(i);
+            --remaining;
+        });
+    }
+    while (remaining > 0) {
+        if (!runPendingTask())
+            std::this_thread::yield();
+    }
+}
+
+void ThreadPool::init(int numThreads)
+{
+    globalPool = std::make_unique<ThreadPool>(numThreads);
+}
+
+ThreadPool &ThreadPool::get()
+{
+    if (!globalPool)
+        init(0);
+    return *globalPool;
+}
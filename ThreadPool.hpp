@@ -0,0 +1,60 @@
+#ifndef RAYTRACING_THREADPOOL_H
+#define RAYTRACING_THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing thread pool.
+//
+// Every thread owns a deque of tasks. A thread pops its own work from the back
+// of its deque and, once that runs dry, steals from the front of the others'.
+// A thread that waits on parallelFor keeps running pending tasks while it
+// waits, so parallel loops may be nested inside tasks without deadlocking.
+class ThreadPool {
+public:
+    // numThreads counts the calling thread, which takes part in parallelFor;
+    // 0 means one thread per hardware core.
+    explicit ThreadPool(int numThreads = 0);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    int size() const { return (int)queues.size(); }
+
+    void submit(std::function<void()> task);
+    // Runs one pending task on the calling thread, if there is one.
+    bool runPendingTask();
+    // Calls func(i) for every i in [0, count) and returns once all are done.
+    void parallelFor(int count, const std::function<void(int)> &func);
+
+    // Process-wide pool shared by the renderer and the BVH builders.
+    static void init(int numThreads);
+    static ThreadPool &get();
+
+private:
+    struct WorkQueue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    void push(int queue, std::function<void()> task);
+    bool popTask(std::function<void()> &task);
+    void workerLoop(int index);
+
+    std::vector<std::unique_ptr<WorkQueue>> queues;
+    std::vector<std::thread> workers;
+    std::mutex sleepMutex;
+    std::condition_variable wakeup;
+    std::atomic<int> pendingTasks{0};
+    std::atomic<unsigned> nextQueue{0};
+    bool shutdown = false;
+};
+
+#endif //RAYTRACING_THREADPOOL_H
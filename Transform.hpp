@@ -0,0 +1,148 @@
+#ifndef RAYTRACING_TRANSFORM_H
+#define RAYTRACING_TRANSFORM_H
+
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include "Vector.hpp"
+#include "Bounds3.hpp"
+#include "global.hpp"
+
+struct Matrix4f {
+    float m[4][4];
+
+    Matrix4f() {
+        std::memset(m, 0, sizeof(m));
+        m[0][0] = m[1][1] = m[2][2] = m[3][3] = 1.f;
+    }
+    Matrix4f(float t00, float t01, float t02, float t03,
+             float t10, float t11, float t12, float t13,
+             float t20, float t21, float t22, float t23,
+             float t30, float t31, float t32, float t33) {
+        m[0][0] = t00; m[0][1] = t01; m[0][2] = t02; m[0][3] = t03;
+        m[1][0] = t10; m[1][1] = t11; m[1][2] = t12; m[1][3] = t13;
+        m[2][0] = t20; m[2][1] = t21; m[2][2] = t22; m[2][3] = t23;
+        m[3][0] = t30; m[3][1] = t31; m[3][2] = t32; m[3][3] = t33;
+    }
+
+    Matrix4f operator*(const Matrix4f &o) const {
+        Matrix4f r;
+        for (int i = 0; i < 4; ++i)
+            for (int j = 0; j < 4; ++j)
+                r.m[i][j] = m[i][0] * o.m[0][j] + m[i][1] * o.m[1][j] +
+                            m[i][2] * o.m[2][j] + m[i][3] * o.m[3][j];
+        return r;
+    }
+
+    Matrix4f transposed() const {
+        return Matrix4f(m[0][0], m[1][0], m[2][0], m[3][0],
+                        m[0][1], m[1][1], m[2][1], m[3][1],
+                        m[0][2], m[1][2], m[2][2], m[3][2],
+                        m[0][3], m[1][3], m[2][3], m[3][3]);
+    }
+
+    // Gauss-Jordan elimination with partial pivoting, in double precision
+    Matrix4f inverse() const {
+        double a[4][8];
+        for (int i = 0; i < 4; ++i)
+            for (int j = 0; j < 4; ++j) {
+                a[i][j] = m[i][j];
+                a[i][j + 4] = (i == j) ? 1.0 : 0.0;
+            }
+        for (int col = 0; col < 4; ++col) {
+            int pivot = col;
+            for (int row = col + 1; row < 4; ++row)
+                if (std::fabs(a[row][col]) > std::fabs(a[pivot][col]))
+                    pivot = row;
+            if (a[pivot][col] == 0.0)
+                throw std::runtime_error("Matrix4f::inverse: singular matrix");
+            if (pivot != col)
+                for (int j = 0; j < 8; ++j)
+                    std::swap(a[col][j], a[pivot][j]);
+            double inv = 1.0 / a[col][col];
+            for (int j = 0; j < 8; ++j)
+                a[col][j] *= inv;
+            for (int row = 0; row < 4; ++row) {
+                if (row == col || a[row][col] == 0.0) continue;
+                double f = a[row][col];
+                for (int j = 0; j < 8; ++j)
+                    a[row][j] -= f * a[col][j];
+            }
+        }
+        Matrix4f r;
+        for (int i = 0; i < 4; ++i)
+            for (int j = 0; j < 4; ++j)
+                r.m[i][j] = (float)a[i][j + 4];
+        return r;
+    }
+};
+
+// Affine transform that keeps its inverse alongside, so points, directions
+// and normals can be carried either way without inverting per ray.
+class Transform {
+public:
+    Transform() {}
+    Transform(const Matrix4f &m) : m(m), mInv(m.inverse()) {}
+    Transform(const Matrix4f &m, const Matrix4f &mInv) : m(m), mInv(mInv) {}
+
+    Transform operator*(const Transform &t) const { return Transform(m * t.m, t.mInv * mInv); }
+    Transform inverse() const { return Transform(mInv, m); }
+    const Matrix4f &matrix() const { return m; }
+
+    Vector3f point(const Vector3f &p) const {
+        return Vector3f(m.m[0][0] * p.x + m.m[0][1] * p.y + m.m[0][2] * p.z + m.m[0][3],
+                        m.m[1][0] * p.x + m.m[1][1] * p.y + m.m[1][2] * p.z + m.m[1][3],
+                        m.m[2][0] * p.x + m.m[2][1] * p.y + m.m[2][2] * p.z + m.m[2][3]);
+    }
+    Vector3f vector(const Vector3f &v) const {
+        return Vector3f(m.m[0][0] * v.x + m.m[0][1] * v.y + m.m[0][2] * v.z,
+                        m.m[1][0] * v.x + m.m[1][1] * v.y + m.m[1][2] * v.z,
+                        m.m[2][0] * v.x + m.m[2][1] * v.y + m.m[2][2] * v.z);
+    }
+    // normals go through the inverse transpose; the result is not normalized
+    Vector3f normal(const Vector3f &n) const {
+        return Vector3f(mInv.m[0][0] * n.x + mInv.m[1][0] * n.y + mInv.m[2][0] * n.z,
+                        mInv.m[0][1] * n.x + mInv.m[1][1] * n.y + mInv.m[2][1] * n.z,
+                        mInv.m[0][2] * n.x + mInv.m[1][2] * n.y + mInv.m[2][2] * n.z);
+    }
+    Bounds3 bounds(const Bounds3 &b) const {
+        Bounds3 ret;
+        for (int corner = 0; corner < 8; ++corner)
+            ret = Union(ret, point(Vector3f(b[corner & 1].x, b[(corner >> 1) & 1].y,
+                                            b[(corner >> 2) & 1].z)));
+        return ret;
+    }
+
+    static Transform Translate(const Vector3f &d) {
+        Matrix4f m(1, 0, 0, d.x, 0, 1, 0, d.y, 0, 0, 1, d.z, 0, 0, 0, 1);
+        Matrix4f mInv(1, 0, 0, -d.x, 0, 1, 0, -d.y, 0, 0, 1, -d.z, 0, 0, 0, 1);
+        return Transform(m, mInv);
+    }
+    static Transform Scale(float x, float y, float z) {
+        Matrix4f m(x, 0, 0, 0, 0, y, 0, 0, 0, 0, z, 0, 0, 0, 0, 1);
+        Matrix4f mInv(1 / x, 0, 0, 0, 0, 1 / y, 0, 0, 0, 0, 1 / z, 0, 0, 0, 0, 1);
+        return Transform(m, mInv);
+    }
+    // rotation by theta degrees around the given axis
+    static Transform Rotate(float theta, const Vector3f &axis) {
+        Vector3f a = normalize(axis);
+        float sinTheta = std::sin(theta * M_PI / 180.f);
+        float cosTheta = std::cos(theta * M_PI / 180.f);
+        Matrix4f m(a.x * a.x + (1 - a.x * a.x) * cosTheta,
+                   a.x * a.y * (1 - cosTheta) - a.z * sinTheta,
+                   a.x * a.z * (1 - cosTheta) + a.y * sinTheta, 0,
+                   a.x * a.y * (1 - cosTheta) + a.z * sinTheta,
+                   a.y * a.y + (1 - a.y * a.y) * cosTheta,
+                   a.y * a.z * (1 - cosTheta) - a.x * sinTheta, 0,
+                   a.x * a.z * (1 - cosTheta) - a.y * sinTheta,
+                   a.y * a.z * (1 - cosTheta) + a.x * sinTheta,
+                   a.z * a.z + (1 - a.z * a.z) * cosTheta, 0,
+                   0, 0, 0, 1);
+        return Transform(m, m.transposed());
+    }
+
+private:
+    Matrix4f m, mInv;
+};
+
+#endif //RAYTRACING_TRANSFORM_H
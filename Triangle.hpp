@@ -3,58 +3,13 @@
 #include "BVH.hpp"
 #include "Intersection.hpp"
 #include "Material.hpp"
-#include "OBJ_Loader.hpp"
+#include "MeshCache.hpp"
+#include "ObjParser.hpp"
 #include "Object.hpp"
 #include "Triangle.hpp"
+#include "TriangleKernel.hpp"
 #include <cassert>
-#include <array>
-
-bool rayTriangleIntersect(const Vector3f &v0, const Vector3f &v1,
-                          const Vector3f &v2, const Vector3f &orig,
-                          const Vector3f &dir, float &tnear, float &u, float &v) {
-    // Vector3f edge1 = v1 - v0;
-    // Vector3f edge2 = v2 - v0;
-    // Vector3f pvec = crossProduct(dir, edge2);
-    // float det = dotProduct(edge1, pvec);
-    // if (det == 0 || det < 0)
-    //     return false;
-
-    // Vector3f tvec = orig - v0;
-    // u = dotProduct(tvec, pvec);
-    // if (u < 0 || u > det)
-    //     return false;
-
-    // Vector3f qvec = crossProduct(tvec, edge1);
-    // v = dotProduct(dir, qvec);
-    // if (v < 0 || u + v > det)
-    //     return false;
-
-    // float invDet = 1 / det;
-
-    // tnear = dotProduct(edge2, qvec) * invDet;
-    // u *= invDet;
-    // v *= invDet;
-
-    // return true;
-    auto E_1 = v1 - v0;
-    auto E_2 = v2 - v0;
-    auto S = orig - v0;
-    auto S_1 = crossProduct(dir, E_2);
-    auto S_2 = crossProduct(S, E_1);
-    auto S_2_dot_E_2 = dotProduct(S_2, E_2);
-    auto S_1_dot_S = dotProduct(S_1, S);
-    auto S_2_dot_D = dotProduct(S_2, dir);
-    Vector3f temp = Vector3f(S_2_dot_E_2, S_1_dot_S, S_2_dot_D);
-    auto S_1_dot_E_1 = dotProduct(S_1, E_1);
-    auto result = (1.0 / S_1_dot_E_1) * temp;
-    if (result.x >= 0 && (1.0 - result.y - result.z) >= 0 && result.y >= 0 && result.z >= 0) {
-        tnear = result.x;
-        u = result.y;
-        v = result.z;
-        return true;
-    }
-    return false;
-}
+#include <stdexcept>
 
 class Triangle : public Object {
 public:
@@ -70,7 +25,7 @@ public:
         e1 = v1 - v0;
         e2 = v2 - v0;
         normal = normalize(crossProduct(e1, e2));
-        area = crossProduct(e1, e2).norm();
+        area = 0.5f * crossProduct(e1, e2).norm();
     }
 
     bool intersect(const Ray &ray) override;
@@ -78,7 +33,10 @@ public:
     bool intersect(const Ray &ray, float &tnear,
                    uint32_t &index) const override;
 
-    Intersection getIntersection(Ray ray) override;
+    // Moller-Trumbore test against the front face within [t_min, t_max]
+    bool hit(const Ray &ray, float &t) const;
+
+    Intersection getIntersection(const Ray &ray) override;
 
     void getSurfaceProperties(const Vector3f &P, const Vector3f &I,
                               const uint32_t &index, const Vector2f &uv,
@@ -92,13 +50,6 @@ public:
 
     Bounds3 getBounds() override;
 
-    void Sample(Intersection &pos, float &pdf) {
-        float x = std::sqrt(get_random_float()), y = get_random_float();
-        pos.coords = v0 * (1.0f - x) + v1 * (x * (1.0f - y)) + v2 * (x * y);
-        pos.normal = this->normal;
-        pdf = 1.0f / area;
-    }
-
     float getArea() {
         return area;
     }
@@ -106,74 +57,150 @@ public:
     bool hasEmit() {
         return m->hasEmission();
     }
+
+    void getEmitters(std::vector<Emitter> &emitters) override {
+        if (hasEmit())
+            emitters.push_back(Emitter::triangle(v0, e1, e2, m->getEmission()));
+    }
 };
 
+// Material for an .mtl entry. The Phong exponent Ns becomes a GGX alpha
+// with the usual sqrt(2 / (Ns + 2)); the refracting illumination models
+// (4, 6, 7, 9) become glass of index Ni, and any other entry with a
+// specular color the diffuse-plus-GGX GLOSSY material. Ke is the emission.
+inline Material *materialFromMtl(const ObjMaterial &mtl) {
+    float roughness = std::max(1e-3f, std::sqrt(2.0f / (mtl.Ns + 2.0f)));
+    Material *material;
+    if (mtl.illum == 4 || mtl.illum == 6 || mtl.illum == 7 || mtl.illum == 9) {
+        material = new Material(roughness < 0.01f ? GLASS : ROUGH_GLASS, mtl.Ke);
+        material->ior = mtl.Ni > 0 ? mtl.Ni : 1.5f;
+    }
+    else if (mtl.Ks.x + mtl.Ks.y + mtl.Ks.z > 0)
+        material = new Material(GLOSSY, mtl.Ke);
+    else
+        material = new Material(DIFFUSE, mtl.Ke);
+    material->Kd = mtl.Kd;
+    material->Ks = mtl.Ks;
+    material->specularExponent = mtl.Ns;
+    material->roughness = roughness;
+    return material;
+}
+
+// Triangle mesh stored as shared vertex positions plus a 32-bit index
+// buffer. The BVH is built over the triangles themselves and its leaves refer
+// to ranges of triangle indices: after the build, triangles are renumbered
+// into leaf order and the data the intersection test reads (first vertex and
+// both edges) is kept per triangle as structure-of-arrays, which the SIMD
+// leaf kernels in TriangleKernel.hpp test several triangles at a time. Leaves
+// hold up to as many triangles as the selected kernel is wide.
+//
+// A whole OBJ file goes into one mesh and one BVH, whatever objects and
+// groups it has; each triangle keeps the material its usemtl gave it.
 class MeshTriangle : public Object {
 public:
-    MeshTriangle(const std::string &filename, Material *mt = new Material()) {
-        objl::Loader loader;
-        loader.LoadFile(filename);
-        area = 0;
-        m = mt;
-        assert(loader.LoadedMeshes.size() == 1);
-        auto mesh = loader.LoadedMeshes[0];
-
-        Vector3f min_vert = Vector3f{std::numeric_limits<float>::infinity(),
-                                     std::numeric_limits<float>::infinity(),
-                                     std::numeric_limits<float>::infinity()};
-        Vector3f max_vert = Vector3f{-std::numeric_limits<float>::infinity(),
-                                     -std::numeric_limits<float>::infinity(),
-                                     -std::numeric_limits<float>::infinity()};
-        for (int i = 0; i < mesh.Vertices.size(); i += 3) {
-            std::array<Vector3f, 3> face_vertices;
-
-            for (int j = 0; j < 3; j++) {
-                auto vert = Vector3f(mesh.Vertices[i + j].Position.X,
-                                     mesh.Vertices[i + j].Position.Y,
-                                     mesh.Vertices[i + j].Position.Z);
-                face_vertices[j] = vert;
-
-                min_vert = Vector3f(std::min(min_vert.x, vert.x),
-                                    std::min(min_vert.y, vert.y),
-                                    std::min(min_vert.z, vert.z));
-                max_vert = Vector3f(std::max(max_vert.x, vert.x),
-                                    std::max(max_vert.y, vert.y),
-                                    std::max(max_vert.z, vert.z));
-            }
-
-            triangles.emplace_back(face_vertices[0], face_vertices[1],
-                                   face_vertices[2], mt);
+    // With a material mt, every triangle takes it; otherwise each takes its
+    // own from the .mtl files, and those without one a default. The mesh and
+    // its BVH come from the MeshCache when it has them, and go into it
+    // otherwise.
+    MeshTriangle(const std::string &filename, Material *mt = nullptr,
+                 BVHAccel::SplitMethod splitMethod = BVHAccel::SplitMethod::SAH) {
+        int maxPrimsInNode = std::max(4, simdWidth());
+        MeshCache cache(filename, splitMethod, maxPrimsInNode);
+        std::vector<ObjMaterial> mtl;
+        if (!cache.load(*this, mtl)) {
+            ObjMesh mesh;
+            if (!loadObj(filename, mesh))
+                throw std::runtime_error("MeshTriangle: cannot load " + filename);
+            build(mesh, splitMethod, maxPrimsInNode);
+            cache.save(*this, mesh.materials, mesh.materialLibraries);
+            mtl = std::move(mesh.materials);
         }
 
-        bounding_box = Bounds3(min_vert, max_vert);
-
-        std::vector<Object *> ptrs;
-        for (auto &tri : triangles) {
-            ptrs.push_back(&tri);
-            area += tri.area;
+        m = mt ? mt : new Material();
+        if (mt || mtl.empty())
+            materialIds = std::vector<uint32_t>();
+        else {
+            // triangles without a usemtl take m, which goes last
+            for (const ObjMaterial &material : mtl)
+                materials.push_back(materialFromMtl(material));
+            materials.push_back(m);
+            for (uint32_t &id : materialIds)
+                if (id == ObjMesh::kNoMaterial)
+                    id = (uint32_t)mtl.size();
         }
-        bvh = new BVHAccel(ptrs);
+        emissive = false;
+        for (uint32_t k = 0; k < numTriangles && !emissive; ++k)
+            emissive = material(k)->hasEmission();
     }
 
-    bool intersect(const Ray &ray) { return true; }
+    // Takes the buffers of mesh, builds the BVH over its triangles and lays
+    // them out in leaf order.
+    void build(ObjMesh &mesh, BVHAccel::SplitMethod splitMethod, int maxPrimsInNode) {
+        // the file is indexed already
+        vertices = std::move(mesh.positions);
+        vertexIndex = std::move(mesh.indices);
+        numTriangles = (uint32_t)(vertexIndex.size() / 3);
+        materialIds.resize(numTriangles);
+
+        std::vector<Bounds3> bounds(numTriangles);
+        bounding_box = Bounds3();
+        area = 0;
+        for (uint32_t k = 0; k < numTriangles; ++k) {
+            const Vector3f &a = vertices[vertexIndex[k * 3]];
+            const Vector3f &b = vertices[vertexIndex[k * 3 + 1]];
+            const Vector3f &c = vertices[vertexIndex[k * 3 + 2]];
+            bounds[k] = Union(Bounds3(a, b), c);
+            bounding_box = Union(bounding_box, bounds[k]);
+            area += 0.5f * crossProduct(b - a, c - a).norm();
+        }
 
-    bool intersect(const Ray &ray, float &tnear, uint32_t &index) const {
-        bool intersect = false;
+        bvh = new BVHAccel(bounds, maxPrimsInNode, splitMethod);
+
+        // renumber the triangles into BVH leaf order
+        std::vector<uint32_t> orderedIndex(vertexIndex.size());
+        for (uint32_t k = 0; k < numTriangles; ++k) {
+            uint32_t src = bvh->primitiveOrder[k];
+            for (int j = 0; j < 3; ++j)
+                orderedIndex[k * 3 + j] = vertexIndex[src * 3 + j];
+            materialIds[k] = mesh.materialIds[src];
+        }
+        vertexIndex.swap(orderedIndex);
+        bvh->primitiveOrder = std::vector<int>();
+
+        // zero padding keeps the kernels' vector loads inside the arrays
+        for (int axis = 0; axis < 3; ++axis) {
+            v0[axis].resize(numTriangles + kTrianglePadding);
+            e1[axis].resize(numTriangles + kTrianglePadding);
+            e2[axis].resize(numTriangles + kTrianglePadding);
+        }
         for (uint32_t k = 0; k < numTriangles; ++k) {
-            const Vector3f &v0 = vertices[vertexIndex[k * 3]];
-            const Vector3f &v1 = vertices[vertexIndex[k * 3 + 1]];
-            const Vector3f &v2 = vertices[vertexIndex[k * 3 + 2]];
-            float t, u, v;
-            if (rayTriangleIntersect(v0, v1, v2, ray.origin, ray.direction, t,
-                                     u, v) &&
-                t < tnear) {
-                tnear = t;
-                index = k;
-                intersect |= true;
+            const Vector3f &a = vertices[vertexIndex[k * 3]];
+            Vector3f ab = vertices[vertexIndex[k * 3 + 1]] - a;
+            Vector3f ac = vertices[vertexIndex[k * 3 + 2]] - a;
+            for (int axis = 0; axis < 3; ++axis) {
+                v0[axis][k] = a[axis];
+                e1[axis][k] = ab[axis];
+                e2[axis][k] = ac[axis];
             }
         }
+    }
 
-        return intersect;
+    bool intersect(const Ray &ray) {
+        TriangleArrays tris = arrays();
+        return bvh->traverseAny(ray, [&](int first, int count, const Ray &ray) {
+            return anyTriangle(tris, first, count, ray);
+        });
+    }
+
+    bool intersect(const Ray &ray, float &tnear, uint32_t &index) const {
+        Ray r = ray;
+        r.t_max = std::min(r.t_max, tnear);
+        int hit = closestHit(r);
+        if (hit < 0)
+            return false;
+        tnear = r.t_max;
+        index = (uint32_t)hit;
+        return true;
     }
 
     Bounds3 getBounds() { return bounding_box; }
@@ -181,16 +208,9 @@ public:
     void getSurfaceProperties(const Vector3f &P, const Vector3f &I,
                               const uint32_t &index, const Vector2f &uv,
                               Vector3f &N, Vector2f &st) const {
-        const Vector3f &v0 = vertices[vertexIndex[index * 3]];
-        const Vector3f &v1 = vertices[vertexIndex[index * 3 + 1]];
-        const Vector3f &v2 = vertices[vertexIndex[index * 3 + 2]];
-        Vector3f e0 = normalize(v1 - v0);
-        Vector3f e1 = normalize(v2 - v1);
-        N = normalize(crossProduct(e0, e1));
-        const Vector2f &st0 = stCoordinates[vertexIndex[index * 3]];
-        const Vector2f &st1 = stCoordinates[vertexIndex[index * 3 + 1]];
-        const Vector2f &st2 = stCoordinates[vertexIndex[index * 3 + 2]];
-        st = st0 * (1 - uv.x - uv.y) + st1 * uv.x + st2 * uv.y;
+        N = faceNormal(index);
+        // no texture coordinates are loaded; use the barycentrics
+        st = uv;
     }
 
     Vector3f evalDiffuseColor(const Vector2f &st) const {
@@ -201,44 +221,132 @@ public:
                     Vector3f(0.937, 0.937, 0.231), pattern);
     }
 
-    Intersection getIntersection(Ray ray) {
+    Intersection getIntersection(const Ray &ray) {
         Intersection intersec;
+        Ray r = ray;
+        int hit = closestHit(r);
+        if (hit < 0)
+            return intersec;
 
-        if (bvh) {
-            intersec = bvh->Intersect(ray);
-        }
-
+        setHit(intersec, ray, hit, r.t_max);
         return intersec;
     }
 
-    void Sample(Intersection &pos, float &pdf) {
-        bvh->Sample(pos, pdf);
-        pos.emit = m->getEmission();
+    void getIntersections(RayPacket &packet, uint32_t rays, Intersection *isects) {
+        // node tests are shared by the packet, leaves are tested ray by ray
+        int hit[RayPacket::kSize];
+        std::fill(hit, hit + packet.count, -1);
+        TriangleArrays tris = arrays();
+        bvh->traversePacket(packet, rays, [&](int first, int count, RayPacket &packet, uint32_t rays) {
+            for (int i = 0; i < packet.count; ++i) {
+                if (!(rays & (1u << i)))
+                    continue;
+                float t = packet.tMax[i];
+                int k = closestTriangle(tris, first, count, packet.rays[i], t);
+                if (k >= 0) {
+                    packet.clip(i, t);
+                    hit[i] = k;
+                }
+            }
+        });
+        for (int i = 0; i < packet.count; ++i) {
+            if (hit[i] < 0)
+                continue;
+            setHit(isects[i], packet.rays[i], hit[i], packet.rays[i].t_max);
+        }
     }
 
     float getArea() {
         return area;
     }
 
+    // whether any triangle emits
     bool hasEmit() {
-        return m->hasEmission();
+        return emissive;
+    }
+
+    void getEmitters(std::vector<Emitter> &emitters) {
+        if (!hasEmit())
+            return;
+        for (uint32_t k = 0; k < numTriangles; ++k)
+            if (material(k)->hasEmission())
+                emitters.push_back(Emitter::triangle(Vector3f(v0[0][k], v0[1][k], v0[2][k]),
+                                                     Vector3f(e1[0][k], e1[1][k], e1[2][k]),
+                                                     Vector3f(e2[0][k], e2[1][k], e2[2][k]),
+                                                     material(k)->getEmission()));
+    }
+
+    Material *material(uint32_t k) const {
+        return materialIds.empty() ? m : materials[materialIds[k]];
+    }
+
+    Vector3f faceNormal(uint32_t k) const {
+        return normalize(crossProduct(Vector3f(e1[0][k], e1[1][k], e1[2][k]),
+                                      Vector3f(e2[0][k], e2[1][k], e2[2][k])));
     }
 
     Bounds3 bounding_box;
-    std::unique_ptr<Vector3f[]> vertices;
+    std::vector<Vector3f> vertices;
     uint32_t numTriangles;
-    std::unique_ptr<uint32_t[]> vertexIndex;
-    std::unique_ptr<Vector2f[]> stCoordinates;
-
-    std::vector<Triangle> triangles;
+    std::vector<uint32_t> vertexIndex;
+    // per triangle, in BVH leaf order: first vertex and the two edges leaving
+    // it, one array per coordinate
+    std::vector<float> v0[3], e1[3], e2[3];
 
     BVHAccel *bvh;
     float area;
 
+    // material of every triangle, unless materialIds is set: then triangle
+    // k, in leaf order, takes materials[materialIds[k]]
     Material *m;
+    std::vector<Material *> materials;
+    std::vector<uint32_t> materialIds;
+    bool emissive;
+
+private:
+    // Fills in the hit of triangle k at distance t. Triangles are hit from
+    // both sides. A back face emits nothing, as lights are sampled on their
+    // front only, and is shaded with the normal turned towards the ray,
+    // unless its material transmits and needs the outward normal to tell
+    // entering from leaving.
+    void setHit(Intersection &intersec, const Ray &ray, int k, float t) {
+        intersec.happened = true;
+        intersec.distance = t;
+        intersec.coords = ray.origin + ray.direction * t;
+        intersec.normal = faceNormal(k);
+        intersec.m = material(k);
+        intersec.emit = intersec.m->m_emission;
+        intersec.obj = this;
+        if (dotProduct(ray.direction, intersec.normal) > 0) {
+            intersec.emit = Vector3f(0.0f);
+            if (!intersec.m->transmits())
+                intersec.normal = -intersec.normal;
+        }
+    }
+
+    TriangleArrays arrays() const {
+        return {{v0[0].data(), v0[1].data(), v0[2].data()},
+                {e1[0].data(), e1[1].data(), e1[2].data()},
+                {e2[0].data(), e2[1].data(), e2[2].data()}};
+    }
+
+    // closest triangle along the ray, or -1; ray.t_max ends at the hit
+    int closestHit(Ray &ray) const {
+        int hit = -1;
+        TriangleArrays tris = arrays();
+        bvh->traverse(ray, [&](int first, int count, Ray &ray) {
+            int k = closestTriangle(tris, first, count, ray, ray.t_max);
+            if (k >= 0)
+                hit = k;
+        });
+        return hit;
+    }
 };
 
-inline bool Triangle::intersect(const Ray &ray) { return true; }
+inline bool Triangle::intersect(const Ray &ray) {
+    float t_tmp;
+    return hit(ray, t_tmp);
+}
 
 inline bool Triangle::intersect(const Ray &ray, float &tnear,
                                 uint32_t &index) const {
@@ -247,30 +355,38 @@ inline bool Triangle::intersect(const Ray &ray, float &tnear,
 
 inline Bounds3 Triangle::getBounds() { return Union(Bounds3(v0, v1), v2); }
 
-inline Intersection Triangle::getIntersection(Ray ray) {
-    Intersection inter;
-
+inline bool Triangle::hit(const Ray &ray, float &t) const {
     if (dotProduct(ray.direction, normal) > 0)
-        return inter;
+        return false;
     double u, v, t_tmp = 0;
     Vector3f pvec = crossProduct(ray.direction, e2);
     double det = dotProduct(e1, pvec);
     if (fabs(det) < EPSILON)
-        return inter;
+        return false;
 
     double det_inv = 1. / det;
     Vector3f tvec = ray.origin - v0;
     u = dotProduct(tvec, pvec) * det_inv;
     if (u < 0 || u > 1)
-        return inter;
+        return false;
     Vector3f qvec = crossProduct(tvec, e1);
     v = dotProduct(ray.direction, qvec) * det_inv;
     if (v < 0 || u + v > 1)
-        return inter;
+        return false;
     t_tmp = dotProduct(e2, qvec) * det_inv;
 
     // find ray triangle intersection
-    if (t_tmp < 0)
+    if (t_tmp < ray.t_min || t_tmp > ray.t_max)
+        return false;
+    t = t_tmp;
+    return true;
+}
+
+inline Intersection Triangle::getIntersection(const Ray &ray) {
+    Intersection inter;
+
+    float t_tmp;
+    if (!hit(ray, t_tmp))
         return inter;
     inter.happened = true;
     inter.emit = this->m->m_emission;
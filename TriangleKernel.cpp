@@ -0,0 +1,247 @@
+#include "TriangleKernel.hpp"
+#include "global.hpp"
+#include <algorithm>
+
+// det = d . (e2 x e1) grows with the length of d and the size of the
+// triangle as well as with the angle between them. Rays count as parallel
+// when det^2 <= EPSILON^2 |d|^2 |e1 x e2|^2, a test on the cosine alone
+// that holds at any mesh scale and direction length (instances pass the
+// direction unnormalized). This returns EPSILON^2 |d|^2.
+static inline float parallelLimit(const Ray &ray)
+{
+    const Vector3f &d = ray.direction;
+    return EPSILON * EPSILON * (d.x * d.x + d.y * d.y + d.z * d.z);
+}
+
+// Every kernel below evaluates the same expressions as this one, one
+// operation at a time and in the same order; the build disables FMA
+// contraction for this file so that holds for the compiled code too.
+static inline bool hitScalar(const TriangleArrays &tris, int k, const Ray &ray,
+                             float limit, float tMax, float &t)
+{
+    const Vector3f &d = ray.direction;
+    float e1x = tris.e1[0][k], e1y = tris.e1[1][k], e1z = tris.e1[2][k];
+    float e2x = tris.e2[0][k], e2y = tris.e2[1][k], e2z = tris.e2[2][k];
+    float px = d.y * e2z - d.z * e2y;
+    float py = d.z * e2x - d.x * e2z;
+    float pz = d.x * e2y - d.y * e2x;
+    float det = e1x * px + e1y * py + e1z * pz;
+    float nx = e1y * e2z - e1z * e2y;
+    float ny = e1z * e2x - e1x * e2z;
+    float nz = e1x * e2y - e1y * e2x;
+    float nn = nx * nx + ny * ny + nz * nz;
+    // both faces count (det < 0 on the back); only near-parallel rays, and
+    // degenerate triangles, are rejected
+    if (det * det <= limit * nn)
+        return false;
+    float invDet = 1.0f / det;
+    float tx = ray.origin.x - tris.v0[0][k];
+    float ty = ray.origin.y - tris.v0[1][k];
+    float tz = ray.origin.z - tris.v0[2][k];
+    float u = (tx * px + ty * py + tz * pz) * invDet;
+    if (u < 0 || u > 1)
+        return false;
+    float qx = ty * e1z - tz * e1y;
+    float qy = tz * e1x - tx * e1z;
+    float qz = tx * e1y - ty * e1x;
+    float v = (d.x * qx + d.y * qy + d.z * qz) * invDet;
+    if (v < 0 || u + v > 1)
+        return false;
+    t = (e2x * qx + e2y * qy + e2z * qz) * invDet;
+    return t >= ray.t_min && t <= tMax;
+}
+
+int closestTriangleScalar(const TriangleArrays &tris, int first, int count,
+                          const Ray &ray, float &tMax)
+{
+    int hit = -1;
+    float limit = parallelLimit(ray);
+    for (int k = first; k < first + count; ++k) {
+        float t;
+        if (hitScalar(tris, k, ray, limit, tMax, t)) {
+            tMax = t;
+            hit = k;
+        }
+    }
+    return hit;
+}
+
+bool anyTriangleScalar(const TriangleArrays &tris, int first, int count,
+                       const Ray &ray)
+{
+    float limit = parallelLimit(ray);
+    for (int k = first; k < first + count; ++k) {
+        float t;
+        if (hitScalar(tris, k, ray, limit, ray.t_max, t))
+            return true;
+    }
+    return false;
+}
+
+#ifdef RAYTRACING_X86_SIMD
+
+// Tests triangles [k, k + 4), lanes at or past `valid` masked off. Returns
+// a bit mask of the hits and stores the distances in t.
+static inline int hitSSE(const TriangleArrays &tris, int k, int valid,
+                         const Ray &ray, float limit, float tMax, float t[4])
+{
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.f);
+    __m128 dx = _mm_set1_ps(ray.direction.x);
+    __m128 dy = _mm_set1_ps(ray.direction.y);
+    __m128 dz = _mm_set1_ps(ray.direction.z);
+    __m128 e1x = _mm_loadu_ps(tris.e1[0] + k), e1y = _mm_loadu_ps(tris.e1[1] + k),
+           e1z = _mm_loadu_ps(tris.e1[2] + k);
+    __m128 e2x = _mm_loadu_ps(tris.e2[0] + k), e2y = _mm_loadu_ps(tris.e2[1] + k),
+           e2z = _mm_loadu_ps(tris.e2[2] + k);
+
+    __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+    __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+    __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+    __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)),
+                            _mm_mul_ps(e1z, pz));
+    __m128 nx = _mm_sub_ps(_mm_mul_ps(e1y, e2z), _mm_mul_ps(e1z, e2y));
+    __m128 ny = _mm_sub_ps(_mm_mul_ps(e1z, e2x), _mm_mul_ps(e1x, e2z));
+    __m128 nz = _mm_sub_ps(_mm_mul_ps(e1x, e2y), _mm_mul_ps(e1y, e2x));
+    __m128 nn = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, nx), _mm_mul_ps(ny, ny)), _mm_mul_ps(nz, nz));
+    __m128 reject = _mm_cmple_ps(_mm_mul_ps(det, det), _mm_mul_ps(_mm_set1_ps(limit), nn));
+    __m128 invDet = _mm_div_ps(one, det);
+
+    __m128 tx = _mm_sub_ps(_mm_set1_ps(ray.origin.x), _mm_loadu_ps(tris.v0[0] + k));
+    __m128 ty = _mm_sub_ps(_mm_set1_ps(ray.origin.y), _mm_loadu_ps(tris.v0[1] + k));
+    __m128 tz = _mm_sub_ps(_mm_set1_ps(ray.origin.z), _mm_loadu_ps(tris.v0[2] + k));
+    __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)),
+                                     _mm_mul_ps(tz, pz)), invDet);
+    reject = _mm_or_ps(reject, _mm_or_ps(_mm_cmplt_ps(u, zero), _mm_cmpgt_ps(u, one)));
+
+    __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+    __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+    __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+    __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)),
+                                     _mm_mul_ps(dz, qz)), invDet);
+    reject = _mm_or_ps(reject, _mm_or_ps(_mm_cmplt_ps(v, zero),
+                                         _mm_cmpgt_ps(_mm_add_ps(u, v), one)));
+
+    __m128 dist = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)),
+                                        _mm_mul_ps(e2z, qz)), invDet);
+    __m128 accept = _mm_and_ps(_mm_cmpge_ps(dist, _mm_set1_ps(ray.t_min)),
+                               _mm_cmple_ps(dist, _mm_set1_ps(tMax)));
+    accept = _mm_andnot_ps(reject, accept);
+    _mm_storeu_ps(t, dist);
+    return _mm_movemask_ps(accept) & ((1 << valid) - 1);
+}
+
+int closestTriangleSSE(const TriangleArrays &tris, int first, int count,
+                       const Ray &ray, float &tMax)
+{
+    int hit = -1;
+    float limit = parallelLimit(ray);
+    for (int k = first; k < first + count; k += 4) {
+        float t[4];
+        int mask = hitSSE(tris, k, std::min(4, first + count - k), ray, limit, tMax, t);
+        // walk the hits in index order, as the scalar loop would
+        for (; mask; mask &= mask - 1) {
+            int lane = __builtin_ctz(mask);
+            if (t[lane] <= tMax) {
+                tMax = t[lane];
+                hit = k + lane;
+            }
+        }
+    }
+    return hit;
+}
+
+bool anyTriangleSSE(const TriangleArrays &tris, int first, int count,
+                    const Ray &ray)
+{
+    float limit = parallelLimit(ray);
+    for (int k = first; k < first + count; k += 4) {
+        float t[4];
+        if (hitSSE(tris, k, std::min(4, first + count - k), ray, limit, ray.t_max, t))
+            return true;
+    }
+    return false;
+}
+
+RAYTRACING_AVX2 static inline int hitAVX2(const TriangleArrays &tris, int k, int valid,
+                                          const Ray &ray, float limit, float tMax, float t[8])
+{
+    const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.f);
+    __m256 dx = _mm256_set1_ps(ray.direction.x);
+    __m256 dy = _mm256_set1_ps(ray.direction.y);
+    __m256 dz = _mm256_set1_ps(ray.direction.z);
+    __m256 e1x = _mm256_loadu_ps(tris.e1[0] + k), e1y = _mm256_loadu_ps(tris.e1[1] + k),
+           e1z = _mm256_loadu_ps(tris.e1[2] + k);
+    __m256 e2x = _mm256_loadu_ps(tris.e2[0] + k), e2y = _mm256_loadu_ps(tris.e2[1] + k),
+           e2z = _mm256_loadu_ps(tris.e2[2] + k);
+
+    __m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+    __m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+    __m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+    __m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)),
+                               _mm256_mul_ps(e1z, pz));
+    __m256 nx = _mm256_sub_ps(_mm256_mul_ps(e1y, e2z), _mm256_mul_ps(e1z, e2y));
+    __m256 ny = _mm256_sub_ps(_mm256_mul_ps(e1z, e2x), _mm256_mul_ps(e1x, e2z));
+    __m256 nz = _mm256_sub_ps(_mm256_mul_ps(e1x, e2y), _mm256_mul_ps(e1y, e2x));
+    __m256 nn = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(nx, nx), _mm256_mul_ps(ny, ny)),
+                              _mm256_mul_ps(nz, nz));
+    __m256 reject = _mm256_cmp_ps(_mm256_mul_ps(det, det), _mm256_mul_ps(_mm256_set1_ps(limit), nn),
+                                  _CMP_LE_OQ);
+    __m256 invDet = _mm256_div_ps(one, det);
+
+    __m256 tx = _mm256_sub_ps(_mm256_set1_ps(ray.origin.x), _mm256_loadu_ps(tris.v0[0] + k));
+    __m256 ty = _mm256_sub_ps(_mm256_set1_ps(ray.origin.y), _mm256_loadu_ps(tris.v0[1] + k));
+    __m256 tz = _mm256_sub_ps(_mm256_set1_ps(ray.origin.z), _mm256_loadu_ps(tris.v0[2] + k));
+    __m256 u = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tx, px), _mm256_mul_ps(ty, py)),
+                                           _mm256_mul_ps(tz, pz)), invDet);
+    reject = _mm256_or_ps(reject, _mm256_or_ps(_mm256_cmp_ps(u, zero, _CMP_LT_OQ),
+                                               _mm256_cmp_ps(u, one, _CMP_GT_OQ)));
+
+    __m256 qx = _mm256_sub_ps(_mm256_mul_ps(ty, e1z), _mm256_mul_ps(tz, e1y));
+    __m256 qy = _mm256_sub_ps(_mm256_mul_ps(tz, e1x), _mm256_mul_ps(tx, e1z));
+    __m256 qz = _mm256_sub_ps(_mm256_mul_ps(tx, e1y), _mm256_mul_ps(ty, e1x));
+    __m256 v = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)),
+                                           _mm256_mul_ps(dz, qz)), invDet);
+    reject = _mm256_or_ps(reject, _mm256_or_ps(_mm256_cmp_ps(v, zero, _CMP_LT_OQ),
+                                               _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_GT_OQ)));
+
+    __m256 dist = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)),
+                                              _mm256_mul_ps(e2z, qz)), invDet);
+    __m256 accept = _mm256_and_ps(_mm256_cmp_ps(dist, _mm256_set1_ps(ray.t_min), _CMP_GE_OQ),
+                                  _mm256_cmp_ps(dist, _mm256_set1_ps(tMax), _CMP_LE_OQ));
+    accept = _mm256_andnot_ps(reject, accept);
+    _mm256_storeu_ps(t, dist);
+    return _mm256_movemask_ps(accept) & ((1 << valid) - 1);
+}
+
+RAYTRACING_AVX2 int closestTriangleAVX2(const TriangleArrays &tris, int first, int count,
+                                        const Ray &ray, float &tMax)
+{
+    int hit = -1;
+    float limit = parallelLimit(ray);
+    for (int k = first; k < first + count; k += 8) {
+        float t[8];
+        int mask = hitAVX2(tris, k, std::min(8, first + count - k), ray, limit, tMax, t);
+        for (; mask; mask &= mask - 1) {
+            int lane = __builtin_ctz(mask);
+            if (t[lane] <= tMax) {
+                tMax = t[lane];
+                hit = k + lane;
+            }
+        }
+    }
+    return hit;
+}
+
+RAYTRACING_AVX2 bool anyTriangleAVX2(const TriangleArrays &tris, int first, int count,
+                                     const Ray &ray)
+{
+    float limit = parallelLimit(ray);
+    for (int k = first; k < first + count; k += 8) {
+        float t[8];
+        if (hitAVX2(tris, k, std::min(8, first + count - k), ray, limit, ray.t_max, t))
+            return true;
+    }
+    return false;
+}
+
+#endif // RAYTRACING_X86_SIMD
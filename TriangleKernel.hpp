@@ -0,0 +1,65 @@
+#ifndef RAYTRACING_TRIANGLEKERNEL_H
+#define RAYTRACING_TRIANGLEKERNEL_H
+
+#include "Ray.hpp"
+#include "Simd.hpp"
+
+// Triangles in structure-of-arrays form: the first vertex and the two edges
+// leaving it, one array per coordinate. The SIMD kernels load whole vectors,
+// so every array must stay readable for kTrianglePadding floats past the
+// last triangle.
+struct TriangleArrays {
+    const float *v0[3], *e1[3], *e2[3];
+};
+
+constexpr int kTrianglePadding = 8;
+
+// Leaf kernels for Moller-Trumbore against both faces of triangles
+// [first, first + count). The SSE and AVX2 versions test 4 and 8 triangles
+// per instruction with the same float operations, in the same order, as the
+// scalar one, so all three make identical hit/miss decisions and return
+// identical distances.
+
+// Closest hit within [ray.t_min, tMax]: returns the triangle index and pulls
+// tMax in to its distance, or returns -1. Of equally distant hits the one
+// with the larger index wins, as in a sequential loop.
+int closestTriangleScalar(const TriangleArrays &tris, int first, int count,
+                          const Ray &ray, float &tMax);
+// Whether any triangle is hit within [ray.t_min, ray.t_max].
+bool anyTriangleScalar(const TriangleArrays &tris, int first, int count,
+                       const Ray &ray);
+
+#ifdef RAYTRACING_X86_SIMD
+int closestTriangleSSE(const TriangleArrays &tris, int first, int count,
+                       const Ray &ray, float &tMax);
+bool anyTriangleSSE(const TriangleArrays &tris, int first, int count,
+                    const Ray &ray);
+int closestTriangleAVX2(const TriangleArrays &tris, int first, int count,
+                        const Ray &ray, float &tMax);
+bool anyTriangleAVX2(const TriangleArrays &tris, int first, int count,
+                     const Ray &ray);
+#endif
+
+inline int closestTriangle(const TriangleArrays &tris, int first, int count,
+                           const Ray &ray, float &tMax) {
+#ifdef RAYTRACING_X86_SIMD
+    if (simdLevel == SimdLevel::AVX2)
+        return closestTriangleAVX2(tris, first, count, ray, tMax);
+    if (simdLevel == SimdLevel::SSE)
+        return closestTriangleSSE(tris, first, count, ray, tMax);
+#endif
+    return closestTriangleScalar(tris, first, count, ray, tMax);
+}
+
+inline bool anyTriangle(const TriangleArrays &tris, int first, int count,
+                        const Ray &ray) {
+#ifdef RAYTRACING_X86_SIMD
+    if (simdLevel == SimdLevel::AVX2)
+        return anyTriangleAVX2(tris, first, count, ray);
+    if (simdLevel == SimdLevel::SSE)
+        return anyTriangleSSE(tris, first, count, ray);
+#endif
+    return anyTriangleScalar(tris, first, count, ray);
+}
+
+#endif //RAYTRACING_TRIANGLEKERNEL_H
@@ -0,0 +1,179 @@
+#include <chrono>
+#include "Wavefront.hpp"
+
+std::atomic<int64_t> WavefrontTracer::stageTime[WavefrontTracer::NumStages];
+
+const char *WavefrontTracer::stageName(Stage stage)
+{
+    static const char *names[NumStages] = {"generate", "extend", "shade", "connect", "compact"};
+    return names[stage];
+}
+
+namespace {
+// adds the lifetime of the timer to one stage's total
+class StageTimer {
+public:
+    explicit StageTimer(std::atomic<int64_t> &total)
+        : total(total), start(std::chrono::steady_clock::now()) {}
+    ~StageTimer() {
+        total += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count();
+    }
+
+private:
+    std::atomic<int64_t> &total;
+    std::chrono::steady_clock::time_point start;
+};
+}
+
+void WavefrontTracer::trace(const std::vector<Ray> &cameraRays, const std::vector<uint32_t> &pixelIndex,
+                            const std::vector<uint32_t> &sampleIndex, std::vector<Vector3f> &result)
+{
+    generate(cameraRays, pixelIndex, sampleIndex);
+    while (!active.empty()) {
+        extend();
+        shade();
+        connect();
+        compact();
+    }
+    result = radiance;
+}
+
+void WavefrontTracer::generate(const std::vector<Ray> &cameraRays, const std::vector<uint32_t> &pixelIndex,
+                               const std::vector<uint32_t> &sampleIndex)
+{
+    StageTimer timer(stageTime[Generate]);
+    size_t n = cameraRays.size();
+    origin.resize(n);
+    direction.resize(n);
+    throughput.assign(n, Vector3f(1.0f));
+    radiance.assign(n, Vector3f(0.0f));
+    depth.assign(n, 0);
+    // the camera ray counts as specular: light it hits directly is seen
+    specularBounce.assign(n, 1);
+    bouncePdf.assign(n, 0.0f);
+    alive.assign(n, 1);
+    samplers.assign(n, Sampler(seed));
+    hitPoint.resize(n);
+    hitNormal.resize(n);
+    hitMaterial.resize(n);
+    hitEmission.resize(n);
+    hitKind.resize(n);
+    shadeKey.resize(n);
+    active.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+        origin[i] = cameraRays[i].origin;
+        direction[i] = cameraRays[i].direction;
+        samplers[i].startPixelSample(pixelIndex[i], sampleIndex[i], Sampler::kCameraDimensions);
+        active[i] = (int)i;
+    }
+}
+
+void WavefrontTracer::extend()
+{
+    StageTimer timer(stageTime[Extend]);
+    for (int path : active) {
+        Intersection inter = scene.intersect(Ray(origin[path], direction[path]));
+        if (!inter.happened) {
+            hitKind[path] = Miss;
+            shadeKey[path] = Miss * kNumMaterialTypes;
+            continue;
+        }
+        hitPoint[path] = inter.coords;
+        hitNormal[path] = inter.normal;
+        hitMaterial[path] = inter.m;
+        hitEmission[path] = inter.emit;
+        if (inter.m->hasEmission())
+            hitKind[path] = Emitter;
+        else if (inter.m->isSpecular())
+            hitKind[path] = Specular;
+        else
+            hitKind[path] = Surface;
+        shadeKey[path] = (uint8_t)(hitKind[path] * kNumMaterialTypes + inter.m->getType());
+    }
+}
+
+void WavefrontTracer::shade()
+{
+    StageTimer timer(stageTime[Shade]);
+    // counting sort by hit kind and material type, so each branch below,
+    // and the BSDF code it calls, runs over one batch
+    int offsets[kNumShadeKeys + 1] = {};
+    for (int path : active)
+        ++offsets[shadeKey[path] + 1];
+    for (int key = 0; key < kNumShadeKeys; ++key)
+        offsets[key + 1] += offsets[key];
+    sorted.resize(active.size());
+    for (int path : active)
+        sorted[offsets[shadeKey[path]]++] = path;
+
+    shadowPath.clear();
+    shadowFrom.clear();
+    shadowTo.clear();
+    shadowContribution.clear();
+    for (int path : sorted) {
+        switch (hitKind[path]) {
+            case Miss: alive[path] = 0; break;
+            case Emitter: shadeEmitter(path); break;
+            case Surface: shadeSurface(path); break;
+            case Specular: bounce(path); break;
+        }
+    }
+}
+
+void WavefrontTracer::shadeEmitter(int path)
+{
+    // light reached through a non-specular bounce shares with that bounce's
+    // shadow ray
+    const Vector3f &emit = hitEmission[path];
+    float weight = scene.emitterWeight(origin[path], bouncePdf[path], specularBounce[path],
+                                       hitPoint[path], hitNormal[path], emit);
+    radiance[path] += throughput[path] * emit * weight;
+    alive[path] = 0;
+}
+
+void WavefrontTracer::shadeSurface(int path)
+{
+    Scene::ShadowRay shadow = scene.sampleDirect(hitPoint[path], hitNormal[path], hitMaterial[path],
+                                                 -direction[path], samplers[path]);
+    shadowPath.push_back(path);
+    shadowFrom.push_back(shadow.from);
+    shadowTo.push_back(shadow.to);
+    shadowContribution.push_back(throughput[path] * shadow.contribution);
+    bounce(path);
+}
+
+void WavefrontTracer::bounce(int path)
+{
+    Ray ray(origin[path], direction[path]);
+    bool specular;
+    if (!scene.sampleBounce(hitPoint[path], hitNormal[path], hitMaterial[path], depth[path],
+                            samplers[path], ray, throughput[path], specular, bouncePdf[path])) {
+        alive[path] = 0;
+        return;
+    }
+    origin[path] = ray.origin;
+    direction[path] = ray.direction;
+    specularBounce[path] = specular;
+    ++depth[path];
+}
+
+void WavefrontTracer::connect()
+{
+    StageTimer timer(stageTime[Connect]);
+    for (size_t i = 0; i < shadowPath.size(); ++i) {
+        if (scene.visible(shadowFrom[i], shadowTo[i]))
+            radiance[shadowPath[i]] += shadowContribution[i];
+    }
+}
+
+void WavefrontTracer::compact()
+{
+    StageTimer timer(stageTime[Compact]);
+    // keep the survivors in shade order; paths that hit the same kind of
+    // surface tend to do similar work next bounce as well
+    active.clear();
+    for (int path : sorted)
+        if (alive[path])
+            active.push_back(path);
+}
@@ -0,0 +1,82 @@
+#ifndef RAYTRACING_WAVEFRONT_H
+#define RAYTRACING_WAVEFRONT_H
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+#include "Scene.hpp"
+#include "Sampler.hpp"
+
+// Wavefront path tracer: the alternative to the per-path loop in
+// Scene::castRay, sharing its sampling steps.
+//
+// A batch of paths advances one bounce at a time through separate stages,
+// each a tight loop over every path still alive:
+//   generate - start a path per camera ray
+//   extend   - find the closest hit of every path's current ray
+//   shade    - sort the paths by what they hit and its material type, add
+//              emission, queue a shadow ray towards a light sample and
+//              pick the next bounce
+//   connect  - trace the queued shadow rays and add the light they carry
+//   compact  - drop the paths that ended
+// Path state lives in one array per field, indexed by path. Each path keeps
+// its own sampler stream, so results do not depend on how paths are
+// grouped or ordered between stages.
+class WavefrontTracer {
+public:
+    WavefrontTracer(const Scene &scene, uint64_t seed) : scene(scene), seed(seed) {}
+
+    // Traces cameraRays[i] for sample sampleIndex[i] of pixel pixelIndex[i]
+    // and writes the path's radiance estimate to radiance[i].
+    void trace(const std::vector<Ray> &cameraRays, const std::vector<uint32_t> &pixelIndex,
+               const std::vector<uint32_t> &sampleIndex, std::vector<Vector3f> &radiance);
+
+    // Time spent in each stage by all tracers, in nanoseconds.
+    enum Stage { Generate, Extend, Shade, Connect, Compact, NumStages };
+    static std::atomic<int64_t> stageTime[NumStages];
+    static const char *stageName(Stage stage);
+
+private:
+    // what a path's ray hit; shade handles each kind as one group
+    // Surface: a material that light sampling applies to; Specular: one
+    // that only scatters into single directions
+    enum HitKind : uint8_t { Miss, Emitter, Surface, Specular, NumHitKinds };
+    // shade sorts on the hit kind first and the material type second
+    static constexpr int kNumShadeKeys = NumHitKinds * kNumMaterialTypes;
+
+    void generate(const std::vector<Ray> &cameraRays, const std::vector<uint32_t> &pixelIndex,
+                  const std::vector<uint32_t> &sampleIndex);
+    void extend();
+    void shade();
+    void shadeEmitter(int path);
+    void shadeSurface(int path);
+    // samples the direction the path continues in, or ends it
+    void bounce(int path);
+    void connect();
+    void compact();
+
+    const Scene &scene;
+    uint64_t seed;
+
+    // path state
+    std::vector<Vector3f> origin, direction, throughput, radiance;
+    std::vector<int> depth;
+    std::vector<uint8_t> specularBounce, alive;
+    // direction pdf of the last bounce, for MIS when it hits an emitter
+    std::vector<float> bouncePdf;
+    std::vector<Sampler> samplers;
+
+    // closest hit of each path's current ray
+    std::vector<Vector3f> hitPoint, hitNormal, hitEmission;
+    std::vector<Material *> hitMaterial;
+    std::vector<uint8_t> hitKind, shadeKey;
+
+    // paths still running, and the same list sorted by shade key
+    std::vector<int> active, sorted;
+
+    // shadow rays queued by shade
+    std::vector<int> shadowPath;
+    std::vector<Vector3f> shadowFrom, shadowTo, shadowContribution;
+};
+
+#endif //RAYTRACING_WAVEFRONT_H
@@ -1,7 +1,6 @@
 #pragma once
 #include <iostream>
 #include <cmath>
-#include <random>
 
 #undef M_PI
 #define M_PI 3.141592653589793f
@@ -12,6 +11,14 @@ const float kInfinity = std::numeric_limits<float>::max();
 inline float clamp(const float &lo, const float &hi, const float &v)
 { return std::max(lo, std::min(hi, v)); }
 
+// Power heuristic (beta = 2) weight of a sample drawn with pdf fPdf when
+// another strategy could have drawn it with pdf gPdf.
+inline float powerHeuristic(float fPdf, float gPdf)
+{
+    float f = fPdf * fPdf, g = gPdf * gPdf;
+    return f > 0 ? f / (f + g) : 0;
+}
+
 inline  bool solveQuadratic(const float &a, const float &b, const float &c, float &x0, float &x1)
 {
     float discr = b * b - 4 * a * c;
@@ -28,15 +35,6 @@ inline  bool solveQuadratic(const float &a, const float &b, const float &c, floa
     return true;
 }
 
-inline float get_random_float()
-{
-    std::random_device dev;
-    std::mt19937 rng(dev());
-    std::uniform_real_distribution<float> dist(0.f, 1.f); // distribution in range [1, 6]
-
-    return dist(rng);
-}
-
 inline void UpdateProgress(float progress)
 {
     int barWidth = 70;
@@ -1,10 +1,14 @@
 #include "Renderer.hpp"
 #include "Scene.hpp"
 #include "Triangle.hpp"
+#include "Instance.hpp"
 #include "Sphere.hpp"
 #include "Vector.hpp"
 #include "global.hpp"
+#include "ThreadPool.hpp"
+#include "Simd.hpp"
 #include <chrono>
+#include <cstring>
 #include <iostream>
 #include <string>
 #include <sstream>
@@ -18,38 +22,63 @@
 // lights) as well as set the options for the render (image width and height,
 // maximum recursion depth, field-of-view, etc.). We then call the render
 // function().
-void getSobolSequence(std::vector<std::vector<double>>& v, std::string filename) {
-    std::fstream sobol;
-    sobol.open(filename);
-    if (!sobol.is_open()) {
-       std::cerr << "open error\n";
-    }
-    std::string line;
-    while (getline(sobol, line)) {
-        std::string line_value;
-        std::stringstream ss(line);
-        std::vector<double> temp;
-        while (std::getline(ss, line_value, ',')) {
-            std::istringstream os(line_value);
-            double d;
-            os >> d;
-            temp.push_back(d);
-        }
-        v.push_back(temp);
-    }
-}
-
 int main(int argc, char **argv) {
 
-    // first get the sobol_sequence from the file
-    std::vector<std::vector<double>> sobol_sequence;
-    std::string filename = "sobol_seq.csv";
-    getSobolSequence(sobol_sequence,filename);
-    for (auto v : sobol_sequence) {
-        std::cout << v[0] << "      " << v[1] << std::endl;
+    // command line options: --threads N (0 = one per core), --spp N, --seed N,
+    // --simd scalar|sse|avx2 (defaults to the widest the CPU supports),
+    // --packets 0|1 (trace camera rays in packets; on by default),
+    // --engine recursive|wavefront,
+    // --adaptive T (spend the spp budget where the relative error is above T;
+    // 0 = off), --heatmap FILE (write the samples per pixel as an image),
+    // --progressive 0|1 (write the image and a checkpoint after every pass),
+    // --checkpoint FILE, --resume 0|1 (continue from the checkpoint),
+    // --output FILE (.ppm, .png, .pfm or .exr; may be repeated, replaces the
+    // default binary.ppm), --cache DIR (where parsed meshes and their BVHs
+    // are kept between runs; "" = off), --scene FILE (render an OBJ file with
+    // its .mtl materials instead of the built-in Cornell box)
+    int num_threads = 0;
+    int spp = 128;
+    uint64_t seed = 0;
+    bool packets = true;
+    bool wavefront = false;
+    float adaptive = 0;
+    std::string heatmap;
+    bool progressive = false, resume = false;
+    std::string checkpoint = "binary.ckpt";
+    std::vector<std::string> outputs;
+    std::string sceneFile;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (!strcmp(argv[i], "--threads")) num_threads = std::atoi(argv[i + 1]);
+        else if (!strcmp(argv[i], "--spp")) spp = std::atoi(argv[i + 1]);
+        else if (!strcmp(argv[i], "--seed")) seed = std::strtoull(argv[i + 1], nullptr, 10);
+        else if (!strcmp(argv[i], "--adaptive")) adaptive = std::atof(argv[i + 1]);
+        else if (!strcmp(argv[i], "--heatmap")) heatmap = argv[i + 1];
+        else if (!strcmp(argv[i], "--progressive")) progressive = std::atoi(argv[i + 1]) != 0;
+        else if (!strcmp(argv[i], "--resume")) resume = std::atoi(argv[i + 1]) != 0;
+        else if (!strcmp(argv[i], "--checkpoint")) checkpoint = argv[i + 1];
+        else if (!strcmp(argv[i], "--output")) outputs.push_back(argv[i + 1]);
+        else if (!strcmp(argv[i], "--cache")) meshCacheDirectory = argv[i + 1];
+        else if (!strcmp(argv[i], "--scene")) sceneFile = argv[i + 1];
+        else if (!strcmp(argv[i], "--packets")) packets = std::atoi(argv[i + 1]) != 0;
+        else if (!strcmp(argv[i], "--engine")) {
+            if (!strcmp(argv[i + 1], "wavefront")) wavefront = true;
+            else if (!strcmp(argv[i + 1], "recursive")) wavefront = false;
+            else std::cerr << "unknown --engine " << argv[i + 1] << "\n";
+        }
+        else if (!strcmp(argv[i], "--simd")) {
+            bool found = false;
+            for (SimdLevel level : {SimdLevel::Scalar, SimdLevel::SSE, SimdLevel::AVX2})
+                if (!strcmp(argv[i + 1], simdLevelName(level))) {
+                    found = true;
+                    if (!setSimdLevel(level))
+                        std::cerr << "--simd " << argv[i + 1] << " is not supported by this CPU\n";
+                }
+            if (!found) std::cerr << "unknown --simd level " << argv[i + 1] << "\n";
+        }
+        else std::cerr << "unknown option " << argv[i] << "\n";
     }
-    std::cout << "Successfully get sobol sequence from file" << std::endl;
-    std::cout << "Print something" << std::endl;
+    ThreadPool::init(num_threads);
+    std::cout << "SIMD: " << simdLevelName(simdLevel) << std::endl;
 
     Scene scene(512, 512);
 
@@ -66,30 +95,46 @@ int main(int argc, char **argv) {
     Material *fun_color = new Material(SPECULAR, Vector3f(0.0f));
     fun_color->Kd = Vector3f(1,1,1)*0.999;
 
-    MeshTriangle floor("../models/cornellbox/floor.obj", white);
-    MeshTriangle shortbox("../models/cornellbox/shortbox.obj", white);
-    MeshTriangle tallbox("../models/cornellbox/tallbox.obj", white);
-    // MeshTriangle tallbox("../models/cornellbox/tallbox.obj", fun_color);
-    MeshTriangle left("../models/cornellbox/left.obj", red);
-    MeshTriangle right("../models/cornellbox/right.obj", green);
-    MeshTriangle light_("../models/cornellbox/light.obj", light);
-
-    // MeshTriangle original("../models/cornellBox_2/CornellBox-Original.obj", red);
-    // scene.Add(&original);
-
-
-    scene.Add(&floor);
-    scene.Add(&shortbox);
-    scene.Add(&tallbox);
-    scene.Add(&left);
-    scene.Add(&right);
-    scene.Add(&light_);
-    // scene.Add(dynamic_cast<Object*>(new Sphere(Vector3f(73,16.5,78), 32, fun_color)));
+    if (!sceneFile.empty()) {
+        // The whole file is one mesh with its own materials. OBJ scenes such
+        // as models/CornellBox_2 face the +z axis and stand on y = 0: turn
+        // it around and scale it to the height of the box the camera frames.
+        MeshTriangle *mesh = new MeshTriangle(sceneFile);
+        Bounds3 b = mesh->getBounds();
+        float s = 548.8f / std::max(b.pMax.y - b.pMin.y, 1e-6f);
+        Vector3f center = b.Centroid();
+        scene.Add(new Instance(mesh, Transform::Translate(Vector3f(278, 0, 279.6f)) *
+                                     Transform::Scale(-s, s, -s) *
+                                     Transform::Translate(Vector3f(-center.x, -b.pMin.y, -center.z))));
+    }
+    else {
+        scene.Add(new MeshTriangle("../models/cornellbox/floor.obj", white));
+        scene.Add(new MeshTriangle("../models/cornellbox/shortbox.obj", white));
+        scene.Add(new MeshTriangle("../models/cornellbox/tallbox.obj", white));
+        // scene.Add(new MeshTriangle("../models/cornellbox/tallbox.obj", fun_color));
+        scene.Add(new MeshTriangle("../models/cornellbox/left.obj", red));
+        scene.Add(new MeshTriangle("../models/cornellbox/right.obj", green));
+        scene.Add(new MeshTriangle("../models/cornellbox/light.obj", light));
+        // scene.Add(dynamic_cast<Object*>(new Sphere(Vector3f(73,16.5,78), 32, fun_color)));
+    }
 
 
     scene.buildBVH();
 
-    Renderer r(sobol_sequence);
+    Renderer r;
+    r.spp = spp;
+    r.seed = seed;
+    r.packetTracing = packets;
+    r.wavefront = wavefront;
+    r.adaptive = adaptive > 0;
+    if (r.adaptive)
+        r.adaptiveThreshold = adaptive;
+    r.heatmapFile = heatmap;
+    r.progressive = progressive;
+    r.resume = resume;
+    r.checkpointFile = checkpoint;
+    if (!outputs.empty())
+        r.outputFiles = outputs;
 
     auto start = std::chrono::system_clock::now();
     r.Render(scene);
@@ -0,0 +1,71 @@
+// Builds BVHs over degenerate inputs with every split method and checks that
+// the trees stay within kMaxBVHDepth, which the traversal stacks are sized
+// for, and still reach every primitive.
+
+#include <cmath>
+#include <cstdio>
+#include <vector>
+#include "BVH.hpp"
+
+namespace {
+constexpr int kMaxPrimsInNode = 8;
+
+// depth of the wide tree below node, and the primitives its leaves hold
+int depthOf(const BVHAccel &bvh, int node, std::vector<int> &count, bool &leavesFit) {
+    int depth = 0;
+    const WideBVHNode &wide = bvh.nodes[node];
+    for (int i = 0; i < wide.numChildren; ++i) {
+        if (wide.nPrimitives[i] == 0) {
+            depth = std::max(depth, depthOf(bvh, wide.child[i], count, leavesFit));
+            continue;
+        }
+        leavesFit &= wide.nPrimitives[i] <= kMaxPrimsInNode;
+        for (int slot = wide.child[i]; slot < wide.child[i] + wide.nPrimitives[i]; ++slot)
+            ++count[slot];
+    }
+    return depth + 1;
+}
+
+bool check(const char *name, const std::vector<Bounds3> &bounds) {
+    bool ok = true;
+    const char *methods[] = {"naive", "sah", "lbvh"};
+    for (BVHAccel::SplitMethod method : {BVHAccel::SplitMethod::NAIVE, BVHAccel::SplitMethod::SAH,
+                                         BVHAccel::SplitMethod::LBVH}) {
+        BVHAccel bvh(bounds, kMaxPrimsInNode, method);
+        std::vector<int> count(bounds.size(), 0);
+        bool leavesFit = true;
+        int depth = depthOf(bvh, 0, count, leavesFit);
+        bool everyOnce = true;
+        for (int c : count)
+            everyOnce &= c == 1;
+        bool pass = depth <= kMaxBVHDepth && leavesFit && everyOnce;
+        printf("%s, %s: depth %d, leaves fit %d, every primitive once %d\n",
+               name, methods[(int)method], depth, leavesFit, everyOnce);
+        ok &= pass;
+    }
+    return ok;
+}
+}
+
+int main()
+{
+    bool ok = true;
+
+    // one box many times over: no split can tell the primitives apart
+    std::vector<Bounds3> same(100000, Bounds3(Vector3f(0, 0, 0), Vector3f(1, 1, 1)));
+    ok &= check("coincident", same);
+
+    // centroids 32 times farther out each along every axis: all but the
+    // farthest fall into the first SAH bucket, so every split peels off one
+    std::vector<Bounds3> geometric;
+    for (int axis = 0; axis < 3; ++axis) {
+        for (int i = 0; i < 55; ++i) {
+            Vector3f p;
+            p[axis] = std::ldexp(1.0f, -149 + 5 * i);
+            geometric.push_back(Bounds3(p, p));
+        }
+    }
+    ok &= check("geometric", geometric);
+
+    return ok ? 0 : 1;
+}
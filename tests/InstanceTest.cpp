@@ -0,0 +1,71 @@
+// Places a finely tessellated sphere with the large scale `--scene` uses and
+// checks that rays aimed at it hit, from outside and from inside. Instances
+// pass the ray direction to the mesh unnormalized, so this is where a
+// triangle test that depended on the direction's length or the size of the
+// triangles lost hits.
+
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include "Instance.hpp"
+
+namespace {
+constexpr int kRings = 48, kSegments = 96;
+constexpr float kRadius = 0.3f;
+
+// a UV sphere around the origin, faces wound outwards
+void writeSphere(const char *path) {
+    std::ofstream obj(path);
+    for (int i = 0; i <= kRings; ++i) {
+        float theta = M_PI * i / kRings;
+        for (int j = 0; j < kSegments; ++j) {
+            float phi = 2 * M_PI * j / kSegments;
+            obj << "v " << kRadius * std::sin(theta) * std::cos(phi) << " " << kRadius * std::cos(theta) << " "
+                << kRadius * std::sin(theta) * std::sin(phi) << "\n";
+        }
+    }
+    for (int i = 0; i < kRings; ++i) {
+        for (int j = 0; j < kSegments; ++j) {
+            int a = i * kSegments + j + 1, b = i * kSegments + (j + 1) % kSegments + 1;
+            int c = a + kSegments, d = b + kSegments;
+            obj << "f " << a << " " << b << " " << d << " " << c << "\n";
+        }
+    }
+}
+}
+
+int main()
+{
+    const char *path = "InstanceTest.obj";
+    writeSphere(path);
+    meshCacheDirectory = "";
+    MeshTriangle mesh(path, new Material());
+    std::remove(path);
+
+    // the transform main.cpp gives a --scene mesh about this size
+    float s = 548.8f / (2 * kRadius);
+    Vector3f center(278, 300, 279.6f);
+    Instance instance(&mesh, Transform::Translate(center) * Transform::Scale(-s, s, -s));
+    float radius = kRadius * s;
+
+    int misses = 0, rays = 0;
+    for (int i = 0; i < 64; ++i) {
+        for (int j = 0; j < 64; ++j, ++rays) {
+            // off the vertices and edges, which Moller-Trumbore may miss
+            float theta = M_PI * (i + 0.37f) / 64, phi = 2 * M_PI * (j + 0.41f) / 64;
+            Vector3f dir(std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi));
+            // from far outside towards the center, and from the center out
+            Intersection outside = instance.getIntersection(Ray(center + dir * (4 * radius), -dir));
+            Intersection inside = instance.getIntersection(Ray(center, dir));
+            // the tessellation lies within 1% of the radius
+            bool ok = outside.happened && std::fabs(outside.distance - 3 * radius) < 0.01f * radius &&
+                      inside.happened && std::fabs(inside.distance - radius) < 0.01f * radius &&
+                      dotProduct(outside.normal, dir) > 0.9f;
+            if (!ok && ++misses <= 10)
+                printf("direction %d: outside %d at %g, inside %d at %g\n", rays, outside.happened,
+                       outside.distance, inside.happened, inside.distance);
+        }
+    }
+    printf("%d of %d directions failed\n", misses, rays);
+    return misses == 0 ? 0 : 1;
+}
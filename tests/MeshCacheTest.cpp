@@ -0,0 +1,163 @@
+// Builds a mesh through the MeshCache, loads it back and checks that rays
+// hit the cached mesh exactly where they hit one built from the OBJ file.
+// A cache that is truncated, whose .mtl file changed or whose nodes point
+// backwards or outside the tree must not load.
+
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include "Triangle.hpp"
+
+namespace {
+constexpr int kRings = 64, kSegments = 128;
+constexpr int kRays = 20000;
+const char *kDirectory = "MeshCacheTest.cache";
+
+// a UV sphere of radius 1 whose lower half emits
+void writeMesh(const char *objPath, const char *mtlPath) {
+    std::ofstream mtl(mtlPath);
+    mtl << "newmtl white\nKd 0.7 0.7 0.7\n\nnewmtl light\nKd 0.5 0.5 0.5\nKe 4 3 2\n";
+    std::ofstream obj(objPath);
+    obj << "mtllib " << std::filesystem::path(mtlPath).filename().string() << "\n";
+    for (int i = 0; i <= kRings; ++i) {
+        float theta = M_PI * i / kRings;
+        for (int j = 0; j < kSegments; ++j) {
+            float phi = 2 * M_PI * j / kSegments;
+            obj << "v " << std::sin(theta) * std::cos(phi) << " " << std::cos(theta) << " "
+                << std::sin(theta) * std::sin(phi) << "\n";
+        }
+    }
+    for (int i = 0; i < kRings; ++i) {
+        if (i == 0 || i == kRings / 2)
+            obj << "usemtl " << (i == 0 ? "white" : "light") << "\n";
+        for (int j = 0; j < kSegments; ++j) {
+            int a = i * kSegments + j + 1, b = i * kSegments + (j + 1) % kSegments + 1;
+            obj << "f " << a << " " << b << " " << b + kSegments << " " << a + kSegments << "\n";
+        }
+    }
+}
+
+std::string readFile(const std::string &path) {
+    std::ifstream in(path, std::ios::binary);
+    std::stringstream content;
+    content << in.rdbuf();
+    return content.str();
+}
+
+void writeFile(const std::string &path, const std::string &content) {
+    std::ofstream(path, std::ios::binary) << content;
+}
+
+bool sameFloat(float a, float b) { return std::memcmp(&a, &b, sizeof(float)) == 0; }
+}
+
+int main()
+{
+    std::filesystem::remove_all(kDirectory);
+    const char *objPath = "MeshCacheTest.obj", *mtlPath = "MeshCacheTest.mtl";
+    writeMesh(objPath, mtlPath);
+
+    meshCacheDirectory = "";
+    MeshTriangle fresh(objPath);
+    meshCacheDirectory = kDirectory;
+    MeshTriangle saved(objPath);
+    std::string cachePath;
+    for (const auto &entry : std::filesystem::directory_iterator(kDirectory))
+        cachePath = entry.path().string();
+    if (cachePath.empty()) {
+        printf("no cache file written\n");
+        return 1;
+    }
+    MeshTriangle cached(objPath);
+
+    // whether the cache file as it stands loads; the mesh it loads into is
+    // built without the cache, which would otherwise replace a bad file
+    auto loads = [&]() {
+        MeshCache cache(objPath, BVHAccel::SplitMethod::SAH, std::max(4, simdWidth()));
+        meshCacheDirectory = "";
+        MeshTriangle scratch(objPath, new Material());
+        meshCacheDirectory = kDirectory;
+        std::vector<ObjMaterial> materials;
+        return cache.load(scratch, materials);
+    };
+    int failures = 0;
+    if (!loads()) {
+        ++failures;
+        printf("the cache does not load\n");
+    }
+
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+    int hits = 0;
+    for (int i = 0; i < kRays; ++i) {
+        Vector3f origin = Vector3f(unit(rng), unit(rng), unit(rng)) * 3.0f;
+        // some pass the sphere by
+        Vector3f target = Vector3f(unit(rng), unit(rng), unit(rng)) * 1.5f;
+        Ray ray(origin, target - origin);
+        Intersection a = fresh.getIntersection(ray), b = cached.getIntersection(ray);
+        hits += a.happened;
+        bool same = a.happened == b.happened &&
+                    (!a.happened || (sameFloat(a.distance, b.distance) && sameFloat(a.normal.x, b.normal.x) &&
+                                     sameFloat(a.normal.y, b.normal.y) && sameFloat(a.normal.z, b.normal.z) &&
+                                     sameFloat(a.emit.x, b.emit.x) && sameFloat(a.emit.y, b.emit.y) &&
+                                     sameFloat(a.emit.z, b.emit.z)));
+        if (!same && ++failures <= 10)
+            printf("ray %d: built hit %d at %g, cached hit %d at %g\n", i, a.happened, a.distance, b.happened,
+                   b.distance);
+    }
+    if (cached.hasEmit() != fresh.hasEmit()) {
+        ++failures;
+        printf("cached mesh emits %d, built mesh %d\n", cached.hasEmit(), fresh.hasEmit());
+    }
+
+    std::string content = readFile(cachePath);
+    writeFile(cachePath, content.substr(0, content.size() - 7));
+    if (loads()) {
+        ++failures;
+        printf("a truncated cache loads\n");
+    }
+    writeFile(cachePath, content);
+
+    std::string mtl = readFile(mtlPath);
+    writeFile(mtlPath, mtl + "Ni 1.4\n");
+    if (loads()) {
+        ++failures;
+        printf("the cache loads after the .mtl file changed\n");
+    }
+    writeFile(mtlPath, mtl);
+
+    // the root, found by its bytes, with an interior child pointed at itself
+    // and then past the last node
+    const WideBVHNode &root = fresh.bvh->nodes[0];
+    size_t rootOffset = content.find(std::string((const char *)&root, sizeof(root)));
+    int interior = -1;
+    for (int i = 0; i < root.numChildren; ++i)
+        if (root.nPrimitives[i] == 0)
+            interior = i;
+    if (rootOffset == std::string::npos || interior < 0) {
+        ++failures;
+        printf("no interior child of the root in the cache\n");
+    }
+    else {
+        for (int child : {0, (int)fresh.bvh->nodes.size()}) {
+            std::string corrupt = content;
+            std::memcpy(&corrupt[rootOffset + offsetof(WideBVHNode, child) + interior * sizeof(int)], &child,
+                        sizeof(int));
+            writeFile(cachePath, corrupt);
+            if (loads()) {
+                ++failures;
+                printf("a cache whose root points at node %d loads\n", child);
+            }
+        }
+    }
+
+    std::filesystem::remove_all(kDirectory);
+    std::remove(objPath);
+    std::remove(mtlPath);
+    printf("%d rays, %d hit, %d failures\n", kRays, hits, failures);
+    return failures == 0 && hits > kRays / 10 ? 0 : 1;
+}
@@ -0,0 +1,147 @@
+// Reads OBJ files large enough to be split into several chunks and checks
+// the merged mesh against what was written: CRLF line ends, v/vt/vn corners,
+// relative indices that reach back into an earlier chunk and materials that
+// stay current across chunk boundaries. Files with faces outside the vertex
+// list or unreadable numbers must be rejected.
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "ObjParser.hpp"
+
+namespace {
+constexpr int kVertices = 120000;
+// far enough back that faces at the start of a chunk refer into the one
+// before it
+constexpr int kReach = 3000;
+// triangles between usemtl lines, many chunks' worth
+constexpr int kMaterialRun = 25000;
+
+struct Expected {
+    std::vector<uint32_t> indices, materialIds;
+};
+
+// vertex i sits at (i, 2i, -i), so positions are easy to check
+Expected writeMesh(const char *path) {
+    std::ofstream obj(path, std::ios::binary);
+    Expected expected;
+    const char *names[] = {"red", "green", "red", "white"};
+    // materials in order of first use
+    const uint32_t ids[] = {0, 1, 0, 2};
+    obj << "# generated\r\n";
+    int triangles = 0, run = -1;
+    for (int i = 0; i < kVertices; ++i) {
+        obj << "v " << i << " " << 2 * i << " " << -i << "\r\n";
+        if (i < kReach)
+            continue;
+        if (triangles >= (run + 1) * kMaterialRun)
+            obj << "usemtl " << names[++run % 4] << "\r\n";
+        uint32_t id = ids[run % 4];
+        switch (i % 3) {
+        case 0:
+            // relative, with texture coordinates and normals
+            obj << "f -1/1/1 -" << kReach / 2 << "/2/1 -" << kReach << "/3/1\r\n";
+            expected.indices.insert(expected.indices.end(), {(uint32_t)i, (uint32_t)(i + 1 - kReach / 2),
+                                                             (uint32_t)(i + 1 - kReach)});
+            break;
+        case 1:
+            // absolute, normals without texture coordinates
+            obj << "f " << i + 1 << "//1 " << i - kReach + 1 << "//1 " << i << "//1 # comment\r\n";
+            expected.indices.insert(expected.indices.end(), {(uint32_t)i, (uint32_t)(i - kReach), (uint32_t)(i - 1)});
+            break;
+        default:
+            // a quad, split into a fan of two
+            obj << "f " << i - 2 << "/1 -1/2 -" << kReach << "/3 " << i - kReach << "/4\r\n";
+            expected.indices.insert(expected.indices.end(), {(uint32_t)(i - 3), (uint32_t)i, (uint32_t)(i + 1 - kReach),
+                                                             (uint32_t)(i - 3), (uint32_t)(i + 1 - kReach),
+                                                             (uint32_t)(i - kReach - 1)});
+            expected.materialIds.push_back(id);
+            ++triangles;
+            break;
+        }
+        expected.materialIds.push_back(id);
+        ++triangles;
+    }
+    return expected;
+}
+
+// a large valid file with one extra line at the end
+bool loadsWith(const char *path, const std::string &line) {
+    writeMesh(path);
+    {
+        std::ofstream obj(path, std::ios::binary | std::ios::app);
+        obj << line << "\r\n";
+    }
+    ObjMesh mesh;
+    return loadObj(path, mesh);
+}
+}
+
+int main()
+{
+    const char *path = "ObjParserTest.obj";
+    Expected expected = writeMesh(path);
+    ObjMesh mesh;
+    int failures = 0;
+    if (!loadObj(path, mesh)) {
+        printf("cannot load the generated file\n");
+        std::remove(path);
+        return 1;
+    }
+
+    if (mesh.positions.size() != (size_t)kVertices) {
+        ++failures;
+        printf("%zu positions, expected %d\n", mesh.positions.size(), kVertices);
+    }
+    for (size_t i = 0; i < mesh.positions.size(); ++i) {
+        const Vector3f &p = mesh.positions[i];
+        if ((p.x != (float)i || p.y != 2.0f * i || p.z != -(float)i) && ++failures <= 10)
+            printf("position %zu is (%g, %g, %g)\n", i, p.x, p.y, p.z);
+    }
+    if (mesh.indices != expected.indices) {
+        ++failures;
+        printf("%zu indices, expected %zu\n", mesh.indices.size(), expected.indices.size());
+        for (size_t k = 0, shown = 0; k < std::min(mesh.indices.size(), expected.indices.size()) && shown < 10; ++k)
+            if (mesh.indices[k] != expected.indices[k] && ++shown)
+                printf("index %zu is %u, expected %u\n", k, mesh.indices[k], expected.indices[k]);
+    }
+    if (mesh.materialIds != expected.materialIds) {
+        ++failures;
+        printf("material ids differ\n");
+    }
+    if (mesh.materials.size() != 3 || mesh.materials[0].name != "red" || mesh.materials[1].name != "green" ||
+        mesh.materials[2].name != "white") {
+        ++failures;
+        printf("%zu materials, expected red, green and white\n", mesh.materials.size());
+    }
+
+    // one more line at the end of the file: faces outside the vertex list
+    // and numbers a float cannot hold are rejected, one that underflows
+    // reads as zero
+    struct Case {
+        std::string line;
+        bool loads;
+    };
+    std::vector<Case> cases = {
+        {"f 1 2 " + std::to_string(kVertices + 1), false},
+        {"f 1/1/1 2/2/2 " + std::to_string(kVertices + 1) + "/3/3", false},
+        {"f -1 -2 -" + std::to_string(kVertices + 1), false},
+        {"f 0 1 2", false},
+        {"f 1 2", false},
+        {"v 1e40 0 0", false},
+        {"v 1e-50 0 0", true},
+        {"f 1 2 " + std::to_string(kVertices), true},
+    };
+    for (const Case &c : cases) {
+        if (loadsWith(path, c.line) != c.loads) {
+            ++failures;
+            printf("\"%s\" %s\n", c.line.c_str(), c.loads ? "was rejected" : "was accepted");
+        }
+    }
+    std::remove(path);
+
+    printf("%zu triangles, %d failures\n", expected.indices.size() / 3, failures);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,214 @@
+// Checks that the SIMD triangle kernels make the same decisions and return
+// the same distances as the scalar one, on random triangles and on the
+// Cornell box models, and that triangles are hit from both sides.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <random>
+#include <string>
+#include <vector>
+#include "TriangleKernel.hpp"
+#include "Triangle.hpp"
+
+namespace {
+constexpr int kTriangles = 4096;
+constexpr int kRays = 20000;
+
+struct Triangles {
+    std::vector<float> v0[3], e1[3], e2[3];
+
+    TriangleArrays arrays() const {
+        return {{v0[0].data(), v0[1].data(), v0[2].data()},
+                {e1[0].data(), e1[1].data(), e1[2].data()},
+                {e2[0].data(), e2[1].data(), e2[2].data()}};
+    }
+};
+
+bool sameFloat(float a, float b) { return std::memcmp(&a, &b, sizeof(float)) == 0; }
+
+// Runs the dispatching kernels at every SIMD level the CPU has over the
+// triangles of every model, on rays from around each model towards points
+// on its triangles, and counts the answers that differ from the scalar
+// level. Each ray is tested against a leaf-sized range holding its target
+// and against the whole mesh.
+int compareOnModels(std::mt19937 &rng, int &rays, int &hits, int &tested) {
+    constexpr int kRaysPerModel = 1000;
+    std::vector<std::string> paths;
+    for (const char *directory : {"models/cornellbox", "models/CornellBox_2"})
+        for (const auto &entry : std::filesystem::directory_iterator(std::string(RAYTRACING_SOURCE_DIR) + "/" + directory))
+            if (entry.path().extension() == ".obj")
+                paths.push_back(entry.path().string());
+    std::sort(paths.begin(), paths.end());
+
+    SimdLevel original = simdLevel;
+    std::vector<SimdLevel> levels;
+    for (SimdLevel level : {SimdLevel::SSE, SimdLevel::AVX2})
+        if (cpuSupports(level))
+            levels.push_back(level);
+    meshCacheDirectory = "";
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    int failures = 0;
+    for (const std::string &path : paths) {
+        MeshTriangle mesh(path, new Material());
+        TriangleArrays arrays = {{mesh.v0[0].data(), mesh.v0[1].data(), mesh.v0[2].data()},
+                                 {mesh.e1[0].data(), mesh.e1[1].data(), mesh.e1[2].data()},
+                                 {mesh.e2[0].data(), mesh.e2[1].data(), mesh.e2[2].data()}};
+        int n = (int)mesh.numTriangles;
+        Bounds3 box = mesh.getBounds();
+        Vector3f extent = box.Diagonal();
+        std::uniform_int_distribution<int> triangleOf(0, n - 1), countOf(1, 24);
+        for (int i = 0; i < kRaysPerModel; ++i, ++rays) {
+            int target = triangleOf(rng);
+            float x = std::sqrt(unit(rng)), y = unit(rng);
+            Vector3f p = Vector3f(arrays.v0[0][target], arrays.v0[1][target], arrays.v0[2][target]) +
+                         Vector3f(arrays.e1[0][target], arrays.e1[1][target], arrays.e1[2][target]) * (x * (1 - y)) +
+                         Vector3f(arrays.e2[0][target], arrays.e2[1][target], arrays.e2[2][target]) * (x * y);
+            // anywhere in the box grown by its size on every side
+            Vector3f origin = box.pMin + Vector3f(extent.x * (3 * unit(rng) - 1), extent.y * (3 * unit(rng) - 1),
+                                                  extent.z * (3 * unit(rng) - 1));
+            Ray ray(origin, p - origin);
+            int first = std::max(0, target - (int)(rng() % 8));
+            int count = std::min(std::max(countOf(rng), target - first + 1), n - first);
+            int ranges[2][2] = {{first, count}, {0, n}};
+            for (int r = 0; r < 2; ++r) {
+                const int *range = ranges[r];
+                setSimdLevel(SimdLevel::Scalar);
+                float tScalar = ray.t_max;
+                int scalarHit = closestTriangle(arrays, range[0], range[1], ray, tScalar);
+                bool scalarAny = anyTriangle(arrays, range[0], range[1], ray);
+                // hits anywhere in the mesh
+                hits += r == 1 && scalarHit >= 0;
+                for (SimdLevel level : levels) {
+                    setSimdLevel(level);
+                    ++tested;
+                    float t = ray.t_max;
+                    int hit = closestTriangle(arrays, range[0], range[1], ray, t);
+                    bool any = anyTriangle(arrays, range[0], range[1], ray);
+                    if (hit != scalarHit || !sameFloat(t, tScalar) || any != scalarAny) {
+                        if (++failures <= 10)
+                            printf("%s, %s: ray %d, triangles [%d, %d): hit %d t %g any %d, scalar hit %d t %g any %d\n",
+                                   path.c_str(), simdLevelName(level), i, range[0], range[0] + range[1], hit, t, any,
+                                   scalarHit, tScalar, scalarAny);
+                    }
+                }
+            }
+        }
+    }
+    setSimdLevel(original);
+    return failures;
+}
+}
+
+int main()
+{
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+    auto vector = [&]() { return Vector3f(unit(rng), unit(rng), unit(rng)); };
+
+    // a mix of ordinary, small, and degenerate (zero area) triangles
+    Triangles tris;
+    for (int axis = 0; axis < 3; ++axis) {
+        tris.v0[axis].resize(kTriangles + kTrianglePadding);
+        tris.e1[axis].resize(kTriangles + kTrianglePadding);
+        tris.e2[axis].resize(kTriangles + kTrianglePadding);
+    }
+    for (int k = 0; k < kTriangles; ++k) {
+        Vector3f v0 = vector(), e1 = vector(), e2 = vector();
+        if (k % 7 == 0) {
+            e1 = e1 * 1e-3f;
+            e2 = e2 * 1e-3f;
+        }
+        if (k % 11 == 0)
+            e2 = e1 * 0.5f;
+        for (int axis = 0; axis < 3; ++axis) {
+            tris.v0[axis][k] = v0[axis];
+            tris.e1[axis][k] = e1[axis];
+            tris.e2[axis][k] = e2[axis];
+        }
+    }
+    TriangleArrays arrays = tris.arrays();
+
+    struct Kernel {
+        const char *name;
+        SimdLevel level;
+        int (*closest)(const TriangleArrays &, int, int, const Ray &, float &);
+        bool (*any)(const TriangleArrays &, int, int, const Ray &);
+    };
+    std::vector<Kernel> kernels;
+#ifdef RAYTRACING_X86_SIMD
+    kernels.push_back({"sse", SimdLevel::SSE, closestTriangleSSE, anyTriangleSSE});
+    kernels.push_back({"avx2", SimdLevel::AVX2, closestTriangleAVX2, anyTriangleAVX2});
+#endif
+
+    int failures = 0, hits = 0, tested = 0;
+    std::uniform_int_distribution<int> firstOf(0, kTriangles - 1), countOf(1, 24);
+    for (int i = 0; i < kRays; ++i) {
+        // aim at a point near one of the leaf's triangles, so that hits are
+        // common, from either side
+        int first = firstOf(rng);
+        int count = std::min(countOf(rng), kTriangles - first);
+        int target = first + (int)(rng() % count);
+        Vector3f p(arrays.v0[0][target] + 0.3f * (arrays.e1[0][target] + arrays.e2[0][target]),
+                   arrays.v0[1][target] + 0.3f * (arrays.e1[1][target] + arrays.e2[1][target]),
+                   arrays.v0[2][target] + 0.3f * (arrays.e1[2][target] + arrays.e2[2][target]));
+        Vector3f origin = vector() * 4.0f;
+        Vector3f dir = p - origin;
+        // unnormalized directions, as instances pass them
+        if (i % 3 == 0)
+            dir = normalize(dir);
+        Ray ray(origin, dir);
+        if (i % 5 == 0)
+            ray.t_min = 0.5f;
+        if (i % 4 == 0)
+            ray.t_max = 1.0f;
+
+        float tScalar = ray.t_max;
+        int scalarHit = closestTriangleScalar(arrays, first, count, ray, tScalar);
+        bool scalarAny = anyTriangleScalar(arrays, first, count, ray);
+        hits += scalarHit >= 0;
+        for (const Kernel &kernel : kernels) {
+            if (!cpuSupports(kernel.level))
+                continue;
+            ++tested;
+            float t = ray.t_max;
+            int hit = kernel.closest(arrays, first, count, ray, t);
+            bool any = kernel.any(arrays, first, count, ray);
+            if (hit != scalarHit || !sameFloat(t, tScalar) || any != scalarAny) {
+                if (++failures <= 10)
+                    printf("%s: ray %d, triangles [%d, %d): hit %d t %g any %d, scalar hit %d t %g any %d\n",
+                           kernel.name, i, first, first + count, hit, t, any, scalarHit, tScalar, scalarAny);
+            }
+        }
+    }
+
+    // triangles are two-sided: a ray leaving a closed mesh has to find the
+    // face it exits through from behind
+    std::vector<float> one[9];
+    for (int i = 0; i < 9; ++i)
+        one[i].assign(1 + kTrianglePadding, 0.0f);
+    one[3][0] = 1.0f; // e1 = +x
+    one[7][0] = 1.0f; // e2 = +y, so the front faces +z
+    TriangleArrays single = {{one[0].data(), one[1].data(), one[2].data()},
+                             {one[3].data(), one[4].data(), one[5].data()},
+                             {one[6].data(), one[7].data(), one[8].data()}};
+    for (float side : {1.0f, -1.0f}) {
+        Ray ray(Vector3f(0.25f, 0.25f, 2.0f * side), Vector3f(0, 0, -side));
+        float t = ray.t_max;
+        int hit = closestTriangleScalar(single, 0, 1, ray, t);
+        if (hit != 0 || t != 2.0f) {
+            ++failures;
+            printf("%s face: hit %d t %g, expected 0 and 2\n", side > 0 ? "front" : "back", hit, t);
+        }
+    }
+
+    printf("%d rays, %d hit, %d kernel comparisons, %d mismatches\n", kRays, hits, tested, failures);
+
+    int modelRays = 0, modelHits = 0, modelTested = 0;
+    int modelFailures = compareOnModels(rng, modelRays, modelHits, modelTested);
+    printf("models: %d rays, %d hit, %d kernel comparisons, %d mismatches\n", modelRays, modelHits, modelTested,
+           modelFailures);
+    // a test without hits would compare nothing but misses
+    return failures == 0 && hits > kRays / 10 && modelFailures == 0 && modelHits > modelRays / 10 ? 0 : 1;
+}